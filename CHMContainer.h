@@ -37,6 +37,11 @@ struct chmFile;
                                "- please use initWithContentsOfFile:")));
 - (BOOL)hasObjectWithPath:(nonnull NSString *)path;
 - (nullable NSData *)dataWithContentsOfObject:(nullable NSString *)objectPath;
+- (BOOL)enumerateContentsOfObject:(nullable NSString *)objectPath
+                       usingBlock:
+                           (nonnull void (^)(NSData *_Nonnull data,
+                                             unsigned long long objectLength,
+                                             BOOL *_Nonnull stop))block;
 - (nullable NSData *)dataWithTableOfContents;
 - (nonnull NSString *)findHomeForPath:(nonnull NSString *)basePath;
 
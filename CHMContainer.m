@@ -48,6 +48,9 @@ typedef NS_ENUM(uint16_t, CHMObject) {
     NS_DESIGNATED_INITIALIZER;
 
 - (BOOL)loadMetadata;
+- (BOOL)resolveObject:(nullable NSString *)path
+                 info:(nonnull struct chmUnitInfo *)info;
+- (nullable NSData *)viewOfObject:(nonnull struct chmUnitInfo *)info;
 
 @end
 
@@ -59,13 +62,18 @@ typedef NS_ENUM(uint16_t, CHMObject) {
 
 - (nullable instancetype)initWithContentsOfURL:(nonnull NSURL *)url {
   if (self = [super init]) {
-    _handle = chm_open(url.fileSystemRepresentation);
+    // Plain reads rather than CHM_OPEN_MMAP: with a mapping, an archive
+    // truncated or on a volume that goes away while open would crash the app
+    // with SIGBUS instead of failing the read.  Views of uncompressed objects
+    // are then private copies, still one copy fewer than retrieving them.
+    _handle = chm_open_ex(url.fileSystemRepresentation, 0);
     if (!_handle) {
       return nil;
     }
 
     if (![self loadMetadata]) {
       chm_close(_handle);
+      _handle = NULL;
       return nil;
     }
   }
@@ -97,9 +105,10 @@ NSString *_Nonnull readTrimmedString(NSData *_Nonnull data,
          CHM_RESOLVE_SUCCESS;
 }
 
-- (nullable NSData *)dataWithContentsOfObject:(nullable NSString *)path {
+- (BOOL)resolveObject:(nullable NSString *)path
+                 info:(nonnull struct chmUnitInfo *)info {
   if (!path) {
-    return nil;
+    return NO;
   }
 
   if ([path hasPrefix:@"/"]) {
@@ -110,12 +119,44 @@ NSString *_Nonnull readTrimmedString(NSData *_Nonnull data,
     path = [NSString stringWithFormat:@"/%@", path];
   }
 
+  return chm_resolve_object(_handle, path.UTF8String, info) ==
+         CHM_RESOLVE_SUCCESS;
+}
+
+- (nullable NSData *)viewOfObject:(nonnull struct chmUnitInfo *)info {
+  // Uncompressed objects can be handed out as views, straight from the
+  // archive if it is mapped, the data keeping the container (and thus the
+  // handle) alive.
+  const unsigned char *view = NULL;
+  if (info->length > 0 &&
+      chm_view_object(_handle, info, &view, 0, info->length) ==
+          (LONGINT64)info->length) {
+    CHMContainer *container = self;
+    return [[NSData alloc]
+        initWithBytesNoCopy:(void *)view
+                     length:info->length
+                deallocator:^(void *_Nonnull bytes, NSUInteger length) {
+                  chm_release_view(container.handle, bytes);
+                }];
+  }
+  if (view) {
+    chm_release_view(_handle, view);
+  }
+
+  return nil;
+}
+
+- (nullable NSData *)dataWithContentsOfObject:(nullable NSString *)path {
   struct chmUnitInfo info;
-  if (chm_resolve_object(_handle, path.UTF8String, &info) !=
-      CHM_RESOLVE_SUCCESS) {
+  if (![self resolveObject:path info:&info]) {
     return nil;
   }
 
+  NSData *view = [self viewOfObject:&info];
+  if (view) {
+    return view;
+  }
+
   void *buffer = malloc(info.length);
   if (!buffer) {
     return nil;
@@ -129,6 +170,46 @@ NSString *_Nonnull readTrimmedString(NSData *_Nonnull data,
   return [NSData dataWithBytesNoCopy:buffer length:info.length];
 }
 
+static int streamObject(struct chmFile *_Nonnull handle,
+                        const unsigned char *_Nonnull buffer, LONGINT64 length,
+                        void *_Nonnull context) {
+  BOOL (^sink)(NSData *) = (__bridge BOOL (^)(NSData *))context;
+  return sink([NSData dataWithBytes:buffer length:(NSUInteger)length])
+             ? CHM_SINK_CONTINUE
+             : CHM_SINK_STOP;
+}
+
+- (BOOL)enumerateContentsOfObject:(nullable NSString *)path
+                       usingBlock:
+                           (nonnull void (^)(NSData *_Nonnull data,
+                                             unsigned long long objectLength,
+                                             BOOL *_Nonnull stop))block {
+  struct chmUnitInfo info;
+  if (![self resolveObject:path info:&info]) {
+    return NO;
+  }
+
+  NSData *view = [self viewOfObject:&info];
+  if (view) {
+    BOOL stop = NO;
+    block(view, info.length, &stop);
+    return YES;
+  }
+
+  // Everything else is decompressed and handed out a block at a time.
+  __block BOOL stopped = NO;
+  BOOL (^sink)(NSData *) = ^BOOL(NSData *data) {
+    block(data, info.length, &stopped);
+    return !stopped;
+  };
+  LONGINT64 streamed = info.length > 0
+                           ? chm_stream_object(_handle, &info, 0, info.length,
+                                               streamObject,
+                                               (__bridge void *)sink)
+                           : 0;
+  return stopped || streamed == (LONGINT64)info.length;
+}
+
 - (nullable NSData *)dataWithTableOfContents {
   return [self dataWithContentsOfObject:self.tocPath];
 }
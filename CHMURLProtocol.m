@@ -104,14 +104,39 @@ static NSMutableDictionary *kBaseURLs = nil;
     return;
   }
 
-  NSData *data = [container
-      dataWithContentsOfObject:url.parameterString
-                                   ? [NSString
-                                         stringWithFormat:@"%@;%@", url.path,
-                                                          url.parameterString]
-                                   : url.path];
-
-  if (!data) {
+  // Objects are handed to the client as they are decompressed, so that
+  // large ones are never held in memory whole.
+  __block BOOL responded = NO;
+  void (^respond)(unsigned long long) = ^(unsigned long long length) {
+    NSURLResponse *response =
+        [[NSURLResponse alloc] initWithURL:self.request.URL
+                                  MIMEType:@"application/octet-stream"
+                     expectedContentLength:(NSInteger)length
+                          textEncodingName:nil];
+    [self.client URLProtocol:self
+          didReceiveResponse:response
+          cacheStoragePolicy:NSURLCacheStorageNotAllowed];
+    responded = YES;
+  };
+
+  __block unsigned long long objectLength = 0;
+  BOOL loaded = [container
+      enumerateContentsOfObject:url.parameterString
+                                    ? [NSString
+                                          stringWithFormat:@"%@;%@", url.path,
+                                                           url.parameterString]
+                                    : url.path
+                     usingBlock:^(NSData *_Nonnull data,
+                                  unsigned long long length,
+                                  BOOL *_Nonnull stop) {
+                       if (!responded) {
+                         respond(length);
+                       }
+                       objectLength = length;
+                       [self.client URLProtocol:self didLoadData:data];
+                     }];
+
+  if (!loaded) {
     [self.client URLProtocol:self
             didFailWithError:[NSError errorWithDomain:NSURLErrorDomain
                                                  code:0
@@ -119,16 +144,9 @@ static NSMutableDictionary *kBaseURLs = nil;
     return;
   }
 
-  NSURLResponse *response =
-      [[NSURLResponse alloc] initWithURL:self.request.URL
-                                MIMEType:@"application/octet-stream"
-                   expectedContentLength:data.length
-                        textEncodingName:nil];
-  [self.client URLProtocol:self
-        didReceiveResponse:response
-        cacheStoragePolicy:NSURLCacheStorageNotAllowed];
-
-  [self.client URLProtocol:self didLoadData:data];
+  if (!responded) {
+    respond(objectLength);
+  }
   [self.client URLProtocolDidFinishLoading:self];
 }
 
@@ -0,0 +1,514 @@
+/***************************************************************************
+ *          bench_chmLib.c - chmlib micro-benchmarks                       *
+ *                           -------------------                           *
+ *                                                                         *
+ *  notes:      Times one of chmlib's hot paths on a .chm archive:         *
+ *                                                                         *
+ *                resolve   path lookups per second; compare a build with  *
+ *                          -DCHM_QUICKREF=0, which scans directory pages  *
+ *                          from the start.  Archives with full 4 KiB and  *
+ *                          8 KiB directory pages show it best.            *
+ *                hits      small reads per second of cached compressed    *
+ *                          data, from 1, 2, 4... threads; compare a       *
+ *                          build with -DCHM_NO_LOCKFREE_CACHE, where      *
+ *                          every hit takes the cache's lock.              *
+ *                batch     page views per second: each fetches a run of   *
+ *                          neighbouring objects and a few shared ones, in *
+ *                          no particular order, one at a time and then    *
+ *                          with chm_retrieve_objects.                     *
+ *                decode    LZX decoding speed on HTML: every .htm and     *
+ *                          .html object, in the order they are stored,    *
+ *                          with the block cache off; compare builds with  *
+ *                          -DLZX_MAINTREE_PAIRS=1 and the like.           *
+ *                                                                         *
+ *              Linux only.  Build with:                                   *
+ *                                                                         *
+ *              cc -O2 -DCHM_MT -DCHM_USE_PREAD -o bench_chmLib            *
+ *                 bench_chmLib.c chm_lib.c lzx.c -lpthread                *
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License as        *
+ *   published by the Free Software Foundation; either version 2.1 of the  *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ ***************************************************************************/
+
+#define _XOPEN_SOURCE 500
+#include "chm_lib.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+
+/* the objects of an archive, in a fixed pseudo-random order */
+struct object_list
+{
+    struct chmUnitInfo *objects;
+    int                 count;
+    int                 room;
+};
+
+static int _collect(struct chmFile *h,
+                    struct chmUnitInfo *ui,
+                    void *context)
+{
+    struct object_list *list = (struct object_list *)context;
+
+    (void)h;
+    if (list->count == list->room)
+    {
+        int room = list->room ? list->room * 2 : 256;
+        struct chmUnitInfo *objects = (struct chmUnitInfo *)
+            realloc(list->objects, room * sizeof(struct chmUnitInfo));
+        if (objects == NULL)
+            return CHM_ENUMERATOR_FAILURE;
+        list->objects = objects;
+        list->room = room;
+    }
+    list->objects[list->count++] = *ui;
+    return CHM_ENUMERATOR_CONTINUE;
+}
+
+static unsigned int _random(unsigned int *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+static void _shuffle(struct object_list *list)
+{
+    unsigned int seed = 1;
+    struct chmUnitInfo ui;
+    int i, j;
+
+    for (i=list->count-1; i>0; i--)
+    {
+        j = (int)(_random(&seed) % (unsigned int)(i + 1));
+        ui = list->objects[i];
+        list->objects[i] = list->objects[j];
+        list->objects[j] = ui;
+    }
+}
+
+static double _seconds(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec / 1e6;
+}
+
+/* resolve every path in the archive, rounds times over */
+static int _bench_resolve(struct chmFile *h,
+                          struct object_list *list,
+                          int rounds)
+{
+    struct chmUnitInfo ui;
+    double start, elapsed;
+    long lookups = (long)rounds * list->count, missed = 0;
+    int r, i;
+
+    start = _seconds();
+    for (r=0; r<rounds; r++)
+        for (i=0; i<list->count; i++)
+            if (chm_resolve_object(h, list->objects[i].path, &ui)
+                    != CHM_RESOLVE_SUCCESS)
+                ++missed;
+    elapsed = _seconds() - start;
+
+    printf("resolve: %d objects, %d rounds: %.0f lookups/s\n",
+           list->count, rounds, elapsed > 0 ? lookups / elapsed : 0.0);
+    if (missed)
+        fprintf(stderr, "%ld lookups failed\n", missed);
+    return missed != 0;
+}
+
+/* compressed objects, in the order they are stored */
+static int _compare_start(const void *a, const void *b)
+{
+    const struct chmUnitInfo *ua = (const struct chmUnitInfo *)a;
+    const struct chmUnitInfo *ub = (const struct chmUnitInfo *)b;
+
+    if (ua->space != ub->space)
+        return ua->space == CHM_COMPRESSED ? -1 : 1;
+    if (ua->start != ub->start)
+        return ua->start < ub->start ? -1 : 1;
+    return 0;
+}
+
+static struct object_list _stored_order(struct object_list *list)
+{
+    struct object_list sorted;
+
+    sorted = *list;
+    sorted.objects = (struct chmUnitInfo *)
+        malloc(list->count * sizeof(struct chmUnitInfo));
+    if (sorted.objects == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memcpy(sorted.objects, list->objects,
+           list->count * sizeof(struct chmUnitInfo));
+    qsort(sorted.objects, sorted.count, sizeof(struct chmUnitInfo),
+          _compare_start);
+    return sorted;
+}
+
+/* threads reading small pieces of objects whose blocks are all cached */
+#define HITS_READS 400000
+#define HITS_CACHE_BLOCKS 256
+struct hits_context
+{
+    struct chmFile     *h;
+    struct chmUnitInfo *objects;
+    int                 count;
+    long                reads;
+    unsigned int        seed;
+    long                failed;
+};
+
+static void *_hits_thread(void *arg)
+{
+    struct hits_context *ctx = (struct hits_context *)arg;
+    unsigned char buf[512];
+    struct chmUnitInfo *ui;
+    LONGUINT64 addr;
+    LONGINT64 len;
+    long i;
+
+    for (i=0; i<ctx->reads; i++)
+    {
+        ui = &ctx->objects[_random(&ctx->seed) % (unsigned int)ctx->count];
+        addr = _random(&ctx->seed) % ui->length;
+        len = 1 + _random(&ctx->seed) % sizeof(buf);
+        if (len > (LONGINT64)(ui->length - addr))
+            len = (LONGINT64)(ui->length - addr);
+        if (chm_retrieve_object(ctx->h, ui, buf, addr, len) != len)
+            ++ctx->failed;
+    }
+    return NULL;
+}
+
+static int _bench_hits(struct chmFile *h,
+                       struct object_list *list,
+                       int maxThreads)
+{
+    struct object_list sorted = _stored_order(list);
+    struct hits_context ctx[64];
+    pthread_t threads[64];
+    struct chmCacheStats before, after;
+    unsigned char *buf;
+    LONGUINT64 limit;
+    double start, elapsed;
+    long failed = 0;
+    int count, t, i;
+
+    /* enough objects to fill half the cache, from the first stored */
+    chm_set_param(h, CHM_PARAM_MAX_BLOCKS_CACHED, HITS_CACHE_BLOCKS);
+    chm_get_cache_stats(h, &before);
+    limit = before.max_bytes / 2;
+    for (count=0, i=0; i<sorted.count; i++)
+    {
+        if (sorted.objects[i].space != CHM_COMPRESSED  ||
+            sorted.objects[i].start + sorted.objects[i].length
+                - sorted.objects[0].start > limit)
+            break;
+        if (sorted.objects[i].length != 0)
+            sorted.objects[count++] = sorted.objects[i];
+    }
+    if (count == 0)
+    {
+        fprintf(stderr, "no compressed objects\n");
+        return 1;
+    }
+
+    /* warm the cache */
+    for (i=0; i<count; i++)
+    {
+        buf = (unsigned char *)malloc((size_t)sorted.objects[i].length);
+        if (buf != NULL)
+            chm_retrieve_object(h, &sorted.objects[i], buf, 0,
+                                (LONGINT64)sorted.objects[i].length);
+        free(buf);
+    }
+
+    if (maxThreads > 64)
+        maxThreads = 64;
+    for (t=1; t<=maxThreads; t*=2)
+    {
+        chm_get_cache_stats(h, &before);
+        start = _seconds();
+        for (i=0; i<t; i++)
+        {
+            ctx[i].h = h;
+            ctx[i].objects = sorted.objects;
+            ctx[i].count = count;
+            ctx[i].reads = HITS_READS / t;
+            ctx[i].seed = (unsigned int)i + 1;
+            ctx[i].failed = 0;
+            if (pthread_create(&threads[i], NULL, _hits_thread, &ctx[i]) != 0)
+            {
+                fprintf(stderr, "cannot start threads\n");
+                exit(1);
+            }
+        }
+        for (i=0; i<t; i++)
+        {
+            pthread_join(threads[i], NULL);
+            failed += ctx[i].failed;
+        }
+        elapsed = _seconds() - start;
+        chm_get_cache_stats(h, &after);
+
+        printf("hits: %d objects, %d threads: %.0f reads/s, %.1f%% hits\n",
+               count, t,
+               elapsed > 0 ? (HITS_READS / t) * t / elapsed : 0.0,
+               after.hits + after.misses > before.hits + before.misses ?
+                   100.0 * (after.hits - before.hits) /
+                   ((after.hits + after.misses) -
+                    (before.hits + before.misses)) : 0.0);
+    }
+
+    free(sorted.objects);
+    if (failed)
+        fprintf(stderr, "%ld reads failed\n", failed);
+    return failed != 0;
+}
+
+/* pages which each pull in PAGE_OWN objects stored together (the page
+ * and its images), and the same PAGE_SHARED ones (style sheets, scripts)
+ */
+#define PAGE_OWN 16
+#define PAGE_SHARED 8
+#define PAGE_OBJECTS (PAGE_OWN + PAGE_SHARED)
+
+static void _page_view(struct object_list *sorted,
+                       int compressed,
+                       unsigned int *seed,
+                       struct chmRetrieval *reqs)
+{
+    struct chmRetrieval req;
+    int first, i, j;
+
+    first = (int)(_random(seed) % (unsigned int)(compressed - PAGE_OWN + 1));
+    for (i=0; i<PAGE_OWN; i++)
+        reqs[i].ui = &sorted->objects[first + i];
+    for (i=0; i<PAGE_SHARED; i++)
+        reqs[PAGE_OWN + i].ui =
+            &sorted->objects[(i * (compressed / PAGE_SHARED)) % compressed];
+    for (i=PAGE_OBJECTS-1; i>0; i--)
+    {
+        j = (int)(_random(seed) % (unsigned int)(i + 1));
+        req = reqs[i];
+        reqs[i] = reqs[j];
+        reqs[j] = req;
+    }
+    for (i=0; i<PAGE_OBJECTS; i++)
+    {
+        reqs[i].addr = 0;
+        reqs[i].len = (LONGINT64)reqs[i].ui->length;
+        reqs[i].result = 0;
+    }
+}
+
+static int _bench_batch(struct chmFile *h,
+                        struct object_list *list,
+                        int pages)
+{
+    struct object_list sorted = _stored_order(list);
+    struct chmRetrieval reqs[PAGE_OBJECTS];
+    unsigned char *bufs[PAGE_OBJECTS];
+    LONGUINT64 maxLen = 0, bytes = 0;
+    double start, single, batched;
+    unsigned int seed;
+    long failed = 0;
+    int compressed, p, i;
+
+    for (compressed=0, i=0; i<sorted.count; i++)
+        if (sorted.objects[i].space == CHM_COMPRESSED  &&
+            sorted.objects[i].length != 0)
+        {
+            if (sorted.objects[i].length > maxLen)
+                maxLen = sorted.objects[i].length;
+            sorted.objects[compressed++] = sorted.objects[i];
+        }
+    if (compressed < PAGE_OWN)
+    {
+        fprintf(stderr, "too few compressed objects\n");
+        return 1;
+    }
+    for (i=0; i<PAGE_OBJECTS; i++)
+        if ((bufs[i] = (unsigned char *)malloc((size_t)maxLen)) == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+    seed = 1;
+    start = _seconds();
+    for (p=0; p<pages; p++)
+    {
+        _page_view(&sorted, compressed, &seed, reqs);
+        for (i=0; i<PAGE_OBJECTS; i++)
+        {
+            if (chm_retrieve_object(h, reqs[i].ui, bufs[i], 0, reqs[i].len)
+                    != reqs[i].len)
+                ++failed;
+            bytes += (LONGUINT64)reqs[i].len;
+        }
+    }
+    single = _seconds() - start;
+
+    seed = 1;
+    start = _seconds();
+    for (p=0; p<pages; p++)
+    {
+        _page_view(&sorted, compressed, &seed, reqs);
+        for (i=0; i<PAGE_OBJECTS; i++)
+            reqs[i].buf = bufs[i];
+        failed += PAGE_OBJECTS - chm_retrieve_objects(h, reqs, PAGE_OBJECTS);
+    }
+    batched = _seconds() - start;
+
+    printf("batch: %d pages of %d objects, %.0f bytes each: "
+           "%.0f pages/s singly, %.0f pages/s batched\n",
+           pages, PAGE_OBJECTS, (double)bytes / pages,
+           single > 0 ? pages / single : 0.0,
+           batched > 0 ? pages / batched : 0.0);
+    for (i=0; i<PAGE_OBJECTS; i++)
+        free(bufs[i]);
+    free(sorted.objects);
+    if (failed)
+        fprintf(stderr, "%ld retrievals failed\n", failed);
+    return failed != 0;
+}
+
+/* decode the HTML of an archive from start to end, rounds times over */
+static int _is_html(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+
+    return dot != NULL  &&  (strcasecmp(dot, ".htm") == 0  ||
+                             strcasecmp(dot, ".html") == 0);
+}
+
+static int _bench_decode(struct chmFile *h,
+                         struct object_list *list,
+                         int rounds)
+{
+    struct object_list sorted = _stored_order(list);
+    LONGUINT64 maxLen = 0, bytes = 0;
+    unsigned char *buf;
+    double start, elapsed;
+    long failed = 0;
+    int html, r, i;
+
+    for (html=0, i=0; i<sorted.count; i++)
+        if (sorted.objects[i].space == CHM_COMPRESSED  &&
+            sorted.objects[i].length != 0  &&
+            _is_html(sorted.objects[i].path))
+        {
+            if (sorted.objects[i].length > maxLen)
+                maxLen = sorted.objects[i].length;
+            sorted.objects[html++] = sorted.objects[i];
+        }
+    if (html == 0)
+    {
+        fprintf(stderr, "no compressed HTML\n");
+        return 1;
+    }
+    buf = (unsigned char *)malloc((size_t)maxLen);
+    if (buf == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    /* every block is decoded afresh, by the one decoder */
+    chm_set_param(h, CHM_PARAM_MAX_BLOCKS_CACHED, 0);
+    chm_set_param(h, CHM_PARAM_MAX_DECODERS, 1);
+
+    start = _seconds();
+    for (r=0; r<rounds; r++)
+        for (i=0; i<html; i++)
+        {
+            if (chm_retrieve_object(h, &sorted.objects[i], buf, 0,
+                                    (LONGINT64)sorted.objects[i].length)
+                    != (LONGINT64)sorted.objects[i].length)
+                ++failed;
+            bytes += sorted.objects[i].length;
+        }
+    elapsed = _seconds() - start;
+
+    printf("decode: %d HTML objects, %d rounds: %.1f MiB/s of HTML\n",
+           html, rounds,
+           elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0.0);
+    free(buf);
+    free(sorted.objects);
+    if (failed)
+        fprintf(stderr, "%ld retrievals failed\n", failed);
+    return failed != 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s resolve <chmfile> [rounds]\n"
+            "       %s hits <chmfile> [threads]\n"
+            "       %s batch <chmfile> [pages]\n"
+            "       %s decode <chmfile> [rounds]\n",
+            argv0, argv0, argv0, argv0);
+    exit(1);
+}
+
+int main(int c, char **v)
+{
+    struct chmFile *h;
+    struct object_list list;
+    const char *mode;
+    int count = 0;
+    int failed = 0;
+
+    if (c < 3  ||  c > 4)
+        usage(v[0]);
+    mode = v[1];
+    if (c == 4)
+        count = atoi(v[3]);
+
+    h = chm_open(v[2]);
+    if (h == NULL)
+    {
+        fprintf(stderr, "failed to open %s\n", v[2]);
+        exit(1);
+    }
+    memset(&list, 0, sizeof(list));
+    if (! chm_enumerate(h, CHM_ENUMERATE_ALL, _collect, &list)  ||
+        list.count == 0)
+    {
+        fprintf(stderr, "no objects in %s\n", v[2]);
+        exit(1);
+    }
+    _shuffle(&list);
+
+    if (strcmp(mode, "resolve") == 0)
+        failed = _bench_resolve(h, &list, count > 0 ? count : 20);
+    else if (strcmp(mode, "hits") == 0)
+        failed = _bench_hits(h, &list, count > 0 ? count : 8);
+    else if (strcmp(mode, "batch") == 0)
+        failed = _bench_batch(h, &list, count > 0 ? count : 2000);
+    else if (strcmp(mode, "decode") == 0)
+        failed = _bench_decode(h, &list, count > 0 ? count : 5);
+    else
+        usage(v[0]);
+
+    chm_close(h);
+    free(list.objects);
+    return failed;
+}
@@ -34,6 +34,8 @@
  * switches (Linux only):                                                  *
  *              CHM_USE_PREAD: compile library to use pread instead of     *
  *                             lseek/read                                  *
+ *              CHM_NO_MMAP:   compile library without support for         *
+ *                             memory-mapped archives (CHM_OPEN_MMAP)      *
  *              CHM_USE_IO64:  compile library to support full 64-bit I/O  *
  *                             as is needed to properly deal with the      *
  *                             64-bit file offsets.                        *
@@ -56,6 +58,7 @@
 
 #include "lzx.h"
 
+#include <ctype.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -84,6 +87,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
+#ifndef CHM_NO_MMAP
+#include <sys/mman.h>
+#define CHM_USE_MMAP 1
+#endif
 /* #include <dmalloc.h> */
 #endif
 
@@ -99,6 +107,7 @@
 
 #else
 #include <pthread.h>
+#include <sched.h>
 
 #define CHM_ACQUIRE_LOCK(a) do {                        \
         pthread_mutex_lock(&(a));                       \
@@ -113,6 +122,34 @@
 #define CHM_RELEASE_LOCK(a) /* do nothing */
 #endif
 
+/* atomics for the lock-free cache hit path; only where the compiler has
+ * the builtins for them.  Elsewhere hits take cache_mutex.
+ */
+#if defined(CHM_MT) && defined(__GNUC__) && !defined(CHM_NO_LOCKFREE_CACHE)
+#define CHM_LOCKFREE_CACHE 1
+#define CHM_LOAD_ACQUIRE(x)     __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define CHM_LOAD_RELAXED(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define CHM_STORE_RELEASE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define CHM_STORE_RELAXED(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define CHM_FENCE_ACQUIRE()     __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define CHM_FENCE_RELEASE()     __atomic_thread_fence(__ATOMIC_RELEASE)
+#define CHM_ADD_RELAXED(x, v)   __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+#define CHM_LOAD_SEQ_CST(x)     __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define CHM_STORE_SEQ_CST(x, v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+#define CHM_ADD_SEQ_CST(x, v)   __atomic_fetch_add(&(x), (v), __ATOMIC_SEQ_CST)
+#else
+#define CHM_LOAD_ACQUIRE(x)     (x)
+#define CHM_LOAD_RELAXED(x)     (x)
+#define CHM_STORE_RELEASE(x, v) ((x) = (v))
+#define CHM_STORE_RELAXED(x, v) ((x) = (v))
+#define CHM_FENCE_ACQUIRE()     /* do nothing */
+#define CHM_FENCE_RELEASE()     /* do nothing */
+#define CHM_ADD_RELAXED(x, v)   ((x) += (v))
+#define CHM_LOAD_SEQ_CST(x)     (x)
+#define CHM_STORE_SEQ_CST(x, v) ((x) = (v))
+#define CHM_ADD_SEQ_CST(x, v)   ((x) += (v))
+#endif
+
 #ifdef WIN32
 #define CHM_NULL_FD (INVALID_HANDLE_VALUE)
 #define CHM_USE_WIN32IO 1
@@ -128,6 +165,67 @@
 #ifndef CHM_MAX_BLOCKS_CACHED
 #define CHM_MAX_BLOCKS_CACHED 5
 #endif
+#ifndef CHM_QUICKREF
+#define CHM_QUICKREF 1
+#endif
+#ifndef CHM_HIT_COUNTERS
+#define CHM_HIT_COUNTERS 16
+#endif
+#ifndef CHM_DEFAULT_BLOCK_LEN
+#define CHM_DEFAULT_BLOCK_LEN 0x8000
+#endif
+#ifndef CHM_MAX_DECODERS
+#ifdef CHM_MT
+#define CHM_MAX_DECODERS 4
+#else
+#define CHM_MAX_DECODERS 1
+#endif
+#endif
+#ifndef CHM_CHECKPOINT_BYTES
+#define CHM_CHECKPOINT_BYTES 0
+#endif
+#ifndef CHM_PARALLEL_DECODE
+#define CHM_PARALLEL_DECODE 1
+#endif
+#ifndef CHM_PARALLEL_MIN_INTERVALS
+#define CHM_PARALLEL_MIN_INTERVALS 8
+#endif
+#ifndef CHM_MAX_WORKERS
+#define CHM_MAX_WORKERS 16
+#endif
+#ifndef CHM_MAX_SPAN_BYTES
+#define CHM_MAX_SPAN_BYTES 0x100000
+#endif
+#ifndef CHM_CHECKPOINT_INTERVAL
+#define CHM_CHECKPOINT_INTERVAL 8
+#endif
+#ifndef CHM_SHARED_CACHE_BYTES
+#define CHM_SHARED_CACHE_BYTES (16*1024*1024)
+#endif
+#ifndef CHM_SHARED_CACHE_STRIPES
+#define CHM_SHARED_CACHE_STRIPES 16
+#endif
+#ifndef CHM_SHARED_CACHE_BUCKETS
+#define CHM_SHARED_CACHE_BUCKETS 256
+#endif
+#ifndef CHM_MAX_DIR_PAGES_CACHED
+#define CHM_MAX_DIR_PAGES_CACHED 64
+#endif
+#ifndef CHM_MAX_CACHE_BYTES
+#define CHM_MAX_CACHE_BYTES (256*1024*1024)
+#endif
+#ifndef CHM_CACHE_CHUNK_BLOCKS
+#define CHM_CACHE_CHUNK_BLOCKS 8
+#endif
+#ifndef CHM_SCRATCH_BUFFERS
+#define CHM_SCRATCH_BUFFERS 4
+#endif
+#ifndef CHM_WINDOW_POOL_BYTES
+#define CHM_WINDOW_POOL_BYTES (4*1024*1024)
+#endif
+#ifndef CHM_DECODER_IDLE_MS
+#define CHM_DECODER_IDLE_MS 60000
+#endif
 
 /*
  * architecture specific defines
@@ -627,6 +725,116 @@ static int _unmarshal_lzxc_control_data(unsigned char **pData,
     return 1;
 }
 
+/* an entry in the cache of decompressed blocks.  Entries are rewritten in
+ * place under cache_mutex, and read without it: seq is odd while the entry
+ * is being rewritten, and a reader which sees it change throws away what
+ * it read.
+ */
+struct chmCacheEntry
+{
+    UInt32              seq;
+    int                 referenced;     /* CLOCK reference bit            */
+    UInt64              block;          /* index of the cached block      */
+    UChar              *data;           /* its decompressed bytes         */
+    Int32               next;           /* next entry in the hash chain   */
+};
+
+/* the cache proper.  Resizing the cache replaces the table, and frees the
+ * old one once no reader can still be looking at it.
+ */
+struct chmCacheTable
+{
+    struct chmCacheEntry *entries;
+    UChar             **chunks;         /* CHM_CACHE_CHUNK_BLOCKS apiece  */
+    Int32              *buckets;
+    Int32               num_buckets;
+    Int32               num_blocks;     /* entries in use                 */
+    Int32               max_blocks;     /* budget, in blocks              */
+    Int32               hand;
+};
+
+/* hits, and the readers looking at the cache without a lock, are counted
+ * on counters spread out to keep threads from fighting over a cache line
+ */
+struct chmHitCounter
+{
+    UInt64              hits;
+    UInt64              readers;
+    UChar               pad[48];
+};
+
+/* the compressed bytes of a run of blocks, read in one go */
+struct chmCmpSpan
+{
+    UChar              *data;
+    UInt64              size;           /* bytes allocated                */
+    UInt64              start;          /* file offset of data[0]         */
+    UInt64              len;            /* bytes read                     */
+};
+
+/* an LZX decoder.  A handle keeps a small pool of these, so that reads in
+ * different reset intervals can decompress in parallel.  users, next_block,
+ * last_used, idle_since and retired belong to the handle's lzx_mutex;
+ * everything else to the decoder's own mutex.
+ */
+struct chmDecoder
+{
+#ifdef CHM_MT
+#ifdef WIN32
+    CRITICAL_SECTION    mutex;
+#else
+    pthread_mutex_t     mutex;
+#endif
+#endif
+    struct LZXstate    *state;
+    int                 last_block;     /* block now in data, or -1       */
+    UChar              *data;           /* its bytes, in window or buffer */
+    UChar              *buffer;         /* for bytes which were translated */
+    UChar              *cbuffer;        /* scratch for compressed bytes   */
+    struct chmCmpSpan   span;           /* blocks being replayed          */
+
+    int                 users;          /* threads using or waiting       */
+    UInt64              next_block;     /* block its latest user wants    */
+    UInt64              last_used;
+    UInt64              idle_since;     /* when its last user left, in ms */
+    int                 retired;        /* dropped from the pool          */
+};
+
+/* a saved decoder state, from just after a block was decompressed, which
+ * lets a seek into a reset interval skip the blocks before it.  Belongs to
+ * the handle's lzx_mutex; the saved state itself never changes.
+ */
+struct chmCheckpoint
+{
+    UInt64              block;          /* last block decompressed        */
+    struct LZXcheckpoint *state;
+    UInt64              size;
+    UInt64              last_used;
+    int                 users;          /* threads restoring from it      */
+    int                 dropped;        /* evicted while in use           */
+};
+
+/* a cached directory page.  Belongs to the handle's dir_mutex; a page is
+ * handed out in place, and kept until released even once replaced.
+ */
+struct chmDirPage
+{
+    Int32               page;           /* index of the page held         */
+    int                 users;          /* fetches not yet released       */
+    int                 dropped;        /* replaced while in use          */
+    UChar               data[1];        /* block_len bytes                */
+};
+
+/* what identifies an archive across handles, for the shared block cache */
+struct chmFileId
+{
+    UInt64              dev;
+    UInt64              ino;
+    UInt64              size;
+    UInt64              mtime;
+    UInt64              mtime_ns;       /* where mtime is in seconds      */
+};
+
 /* the structure used for chm file handles */
 struct chmFile
 {
@@ -636,15 +844,21 @@ struct chmFile
     int                 fd;
 #endif
 
+    /* read-only mapping of the whole file, if opened with CHM_OPEN_MMAP */
+    UChar              *map;
+    UInt64              map_len;
+
 #ifdef CHM_MT
 #ifdef WIN32
     CRITICAL_SECTION    mutex;
     CRITICAL_SECTION    lzx_mutex;
     CRITICAL_SECTION    cache_mutex;
+    CRITICAL_SECTION    dir_mutex;
 #else
     pthread_mutex_t     mutex;
     pthread_mutex_t     lzx_mutex;
     pthread_mutex_t     cache_mutex;
+    pthread_mutex_t     dir_mutex;
 #endif
 #endif
 
@@ -654,26 +868,75 @@ struct chmFile
     Int32               index_root;
     Int32               index_head;
     UInt32              block_len;
+    UInt32              qr_density;
 
     UInt64              span;
     struct chmUnitInfo  rt_unit;
     struct chmUnitInfo  cn_unit;
     struct chmLzxcResetTable reset_table;
 
+    /* the reset table's block offsets, plus the compressed length; loaded
+     * on first use, or at open time with CHM_OPEN_PRELOAD_RESET_TABLE.
+     * rt_state is 0 before the first attempt, 1 once loaded, and -1 if
+     * the table could not be loaded (then it is read entry by entry).
+     */
+    UInt64             *rt_offsets;
+    int                 rt_state;
+
     /* LZX control data */
     int                 compression_enabled;
     UInt32              window_size;
     UInt32              reset_interval;
     UInt32              reset_blkcount;
 
-    /* decompressor state */
-    struct LZXstate    *lzx_state;
-    int                 lzx_last_block;
+    /* decompressor state: a pool of decoders, guarded by lzx_mutex */
+    struct chmDecoder **decoders;
+    Int32               num_decoders;
+    UInt64              decoder_clock;
+
+    /* decoder state checkpoints, also guarded by lzx_mutex */
+    struct chmCheckpoint **checkpoints;
+    Int32               num_checkpoints;
+    UInt64              checkpoint_bytes;
+    UInt64              checkpoint_budget;
+    UInt32              checkpoint_interval;
+
+    /* threads a read spanning several reset intervals may be decoded on;
+     * read without a lock
+     */
+    Int32               parallel_decode;
+
+    /* cache for decompressed blocks: entries are replaced in CLOCK order,
+     * and found through hash chains keyed on the block index
+     */
+    struct chmCacheTable *cache;
+    struct chmHitCounter cache_hits[CHM_HIT_COUNTERS];
+    UInt64              cache_misses;
+    UInt64              cache_evictions;
+
+    /* use the process-wide block cache, if opened with CHM_OPEN_SHARED_CACHE */
+    int                 shared_cache;
+    struct chmFileId    file_id;
+
+    /* spare scratch buffers, each big enough for a directory page or a
+     * decompressed block, kept between calls; guarded by cache_mutex
+     */
+    UChar              *scratch[CHM_SCRATCH_BUFFERS];
+    int                 num_scratch;
+    UInt64              scratch_len;
+
+    /* cache for directory pages: page p may be held in slot
+     * p % cache_num_dir_pages, if that slot is not NULL
+     */
+    struct chmDirPage **cache_dir_pages;
+    Int32               cache_num_dir_pages;
 
-    /* cache for decompressed blocks */
-    UChar             **cache_blocks;
-    UInt64             *cache_block_indices;
-    Int32               cache_num_blocks;
+    /* place in the list of open handles, which is searched for idle
+     * decoders; guarded by the list's mutex
+     */
+    struct chmFile     *prev_open;
+    struct chmFile     *next_open;
+    int                 listed;
 };
 
 /*
@@ -690,6 +953,17 @@ static Int64 _chm_fetch_bytes(struct chmFile *h,
     if (h->fd  ==  CHM_NULL_FD)
         return readLen;
 
+    /* mapped files need neither a syscall nor the lock */
+    if (h->map != NULL)
+    {
+        if (os >= h->map_len  ||  len <= 0)
+            return readLen;
+        if ((UInt64)len > h->map_len - os)
+            len = (Int64)(h->map_len - os);
+        memcpy(buf, h->map + os, (size_t)len);
+        return len;
+    }
+
     CHM_ACQUIRE_LOCK(h->mutex);
 #ifdef CHM_USE_WIN32IO
     /* NOTE: this might be better done with CreateFileMapping, et cetera... */
@@ -742,157 +1016,1535 @@ static Int64 _chm_fetch_bytes(struct chmFile *h,
     return readLen;
 }
 
-/* open an ITS archive */
-#ifdef PPC_BSTR
-/* RWE 6/12/2003 */
-struct chmFile *chm_open(BSTR filename)
-#else
-struct chmFile *chm_open(const char *filename)
-#endif
+/*
+ * the decompressed block cache
+ */
+
+/* the size of a decompressed block */
+static UInt64 _chm_block_len(struct chmFile *h)
 {
-    unsigned char               sbuffer[256];
-    unsigned int                sremain;
-    unsigned char              *sbufpos;
-    struct chmFile             *newHandle=NULL;
-    struct chmItsfHeader        itsfHeader;
-    struct chmItspHeader        itspHeader;
-#if 0
-    struct chmUnitInfo          uiSpan;
-#endif
-    struct chmUnitInfo          uiLzxc;
-    struct chmLzxcControlData   ctlData;
+    if (h->compression_enabled  &&  h->reset_table.block_len != 0)
+        return h->reset_table.block_len;
+    return CHM_DEFAULT_BLOCK_LEN;
+}
 
-    /* allocate handle */
-    newHandle = (struct chmFile *)malloc(sizeof(struct chmFile));
-    if (newHandle == NULL)
-        return NULL;
-    newHandle->fd = CHM_NULL_FD;
-    newHandle->lzx_state = NULL;
-    newHandle->cache_blocks = NULL;
-    newHandle->cache_block_indices = NULL;
-    newHandle->cache_num_blocks = 0;
+/* how many entries of entryLen bytes apiece a cache may be given: count,
+ * or fewer if they would take more than CHM_MAX_CACHE_BYTES.  -1 if their
+ * size would not even fit in a size_t.
+ */
+static Int32 _chm_cache_cap(Int32 count, UInt64 entryLen)
+{
+    if (count <= 0  ||  entryLen == 0)
+        return count;
+    if ((UInt64)count > (UInt64)SIZE_MAX / entryLen)
+        return -1;
+    if ((UInt64)count * entryLen > (UInt64)CHM_MAX_CACHE_BYTES)
+        count = (Int32)((UInt64)CHM_MAX_CACHE_BYTES / entryLen);
+    return count;
+}
 
-    /* open file */
-#ifdef WIN32
-#ifdef PPC_BSTR
-    if ((newHandle->fd=CreateFile(filename,
-                                  GENERIC_READ,
-                                  FILE_SHARE_READ,
-                                  NULL,
-                                  OPEN_EXISTING,
-                                  FILE_ATTRIBUTE_NORMAL,
-                                  NULL)) == CHM_NULL_FD)
-    {
-        free(newHandle);
-        return NULL;
-    }
-#else
-    if ((newHandle->fd=CreateFileA(filename,
-                                   GENERIC_READ,
-                                   0,
-                                   NULL,
-                                   OPEN_EXISTING,
-                                   FILE_ATTRIBUTE_NORMAL,
-                                   NULL)) == CHM_NULL_FD)
+static void _chm_cache_free_table(struct chmCacheTable *t)
+{
+    Int32 i;
+
+    if (t == NULL)
+        return;
+    for (i=0; t->chunks != NULL  &&
+              i<(t->max_blocks + CHM_CACHE_CHUNK_BLOCKS - 1)
+                / CHM_CACHE_CHUNK_BLOCKS; i++)
+        free(t->chunks[i]);
+    free(t->chunks);
+    free(t->entries);
+    free(t->buckets);
+    free(t);
+}
+
+/* free the cache */
+static void _chm_cache_free(struct chmFile *h)
+{
+    _chm_cache_free_table(h->cache);
+    h->cache = NULL;
+}
+
+/* borrow a scratch buffer, reusing a spare one if there is one */
+static UChar *_chm_get_scratch(struct chmFile *h)
+{
+    UChar *buf = NULL;
+
+    CHM_ACQUIRE_LOCK(h->cache_mutex);
+    if (h->num_scratch > 0)
+        buf = h->scratch[--h->num_scratch];
+    CHM_RELEASE_LOCK(h->cache_mutex);
+
+    if (buf == NULL)
+        buf = (UChar *)malloc((size_t)h->scratch_len);
+    return buf;
+}
+
+/* give a scratch buffer back, keeping it for next time if there's room */
+static void _chm_put_scratch(struct chmFile *h, UChar *buf)
+{
+    if (buf == NULL)
+        return;
+    CHM_ACQUIRE_LOCK(h->cache_mutex);
+    if (h->num_scratch < CHM_SCRATCH_BUFFERS)
     {
-        free(newHandle);
-        return NULL;
+        h->scratch[h->num_scratch++] = buf;
+        buf = NULL;
     }
-#endif
-#else
-    if ((newHandle->fd=open(filename, O_RDONLY)) == CHM_NULL_FD)
+    CHM_RELEASE_LOCK(h->cache_mutex);
+    free(buf);
+}
+
+/* free the spare scratch buffers */
+static void _chm_free_scratch(struct chmFile *h)
+{
+    while (h->num_scratch > 0)
+        free(h->scratch[--h->num_scratch]);
+}
+
+/* replace the cache with an empty one with room for maxBlocks blocks, or
+ * as many as CHM_MAX_CACHE_BYTES allows.  must have cache_mutex.
+ */
+static void _chm_cache_resize(struct chmFile *h, Int32 maxBlocks)
+{
+    struct chmCacheTable *t, *old = h->cache;
+    Int32 i;
+
+    maxBlocks = _chm_cache_cap(maxBlocks, _chm_block_len(h)
+                                          + sizeof(struct chmCacheEntry));
+    if (maxBlocks < 0)
+        return;
+
+    t = (struct chmCacheTable *)malloc(sizeof(struct chmCacheTable));
+    if (t == NULL)
+        return;
+    t->entries = NULL;
+    t->chunks = NULL;
+    t->buckets = NULL;
+    t->num_buckets = 0;
+    t->num_blocks = 0;
+    t->max_blocks = 0;
+    t->hand = 0;
+
+    if (maxBlocks > 0)
     {
-        free(newHandle);
-        return NULL;
+        /* keep chains short: at least as many buckets as entries */
+        t->num_buckets = 1;
+        while (t->num_buckets < maxBlocks)
+            t->num_buckets <<= 1;
+        t->entries = (struct chmCacheEntry *)malloc(
+                    maxBlocks * sizeof(struct chmCacheEntry));
+        t->buckets = (Int32 *)malloc(t->num_buckets * sizeof(Int32));
+
+        /* the blocks themselves are allocated a chunk at a time, as
+         * entries come into use
+         */
+        t->chunks = (UChar **)calloc((maxBlocks + CHM_CACHE_CHUNK_BLOCKS - 1)
+                                     / CHM_CACHE_CHUNK_BLOCKS,
+                                     sizeof(UChar *));
+        if (t->entries == NULL  ||  t->buckets == NULL  ||  t->chunks == NULL)
+        {
+            free(t->entries);
+            free(t->buckets);
+            free(t->chunks);
+            free(t);
+            return;
+        }
+        for (i=0; i<t->num_buckets; i++)
+            t->buckets[i] = -1;
+        t->max_blocks = maxBlocks;
     }
-#endif
 
-    /* initialize mutexes, if needed */
-#ifdef CHM_MT
+    CHM_STORE_SEQ_CST(h->cache, t);
+
+#ifdef CHM_LOCKFREE_CACHE
+    /* readers counted on a slot before the new table went in may still be
+     * in the old one; once a slot has been seen empty, they have all left.
+     * Readers never wait on cache_mutex while counted.
+     */
+    for (i=0; i<CHM_HIT_COUNTERS; i++)
+    {
+        while (CHM_LOAD_SEQ_CST(h->cache_hits[i].readers) != 0)
+        {
 #ifdef WIN32
-    InitializeCriticalSection(&newHandle->mutex);
-    InitializeCriticalSection(&newHandle->lzx_mutex);
-    InitializeCriticalSection(&newHandle->cache_mutex);
+            Sleep(0);
 #else
-    pthread_mutex_init(&newHandle->mutex, NULL);
-    pthread_mutex_init(&newHandle->lzx_mutex, NULL);
-    pthread_mutex_init(&newHandle->cache_mutex, NULL);
+            sched_yield();
 #endif
+        }
+    }
 #endif
+    _chm_cache_free_table(old);
+}
 
-    /* read and verify header */
-    sremain = _CHM_ITSF_V3_LEN;
-    sbufpos = sbuffer;
-    if (_chm_fetch_bytes(newHandle, sbuffer, (UInt64)0, sremain) != sremain    ||
-        !_unmarshal_itsf_header(&sbufpos, &sremain, &itsfHeader))
-    {
-        chm_close(newHandle);
-        return NULL;
-    }
+/* find the cache entry holding a block; -1 if none.  must have cache_mutex */
+static Int32 _chm_cache_find(struct chmCacheTable *t, UInt64 block)
+{
+    Int32 i;
 
-    /* stash important values from header */
-    newHandle->dir_offset  = itsfHeader.dir_offset;
-    newHandle->dir_len     = itsfHeader.dir_len;
-    newHandle->data_offset = itsfHeader.data_offset;
+    if (t == NULL  ||  t->num_buckets == 0)
+        return -1;
+    i = t->buckets[block & (t->num_buckets - 1)];
+    while (i != -1  &&  t->entries[i].block != block)
+        i = t->entries[i].next;
+    return i;
+}
 
-    /* now, read and verify the directory header chunk */
-    sremain = _CHM_ITSP_V1_LEN;
-    sbufpos = sbuffer;
-    if (_chm_fetch_bytes(newHandle, sbuffer,
-                         (UInt64)itsfHeader.dir_offset, sremain) != sremain       ||
-        !_unmarshal_itsp_header(&sbufpos, &sremain, &itspHeader))
+/* unlink an entry from its hash chain.  must have cache_mutex */
+static void _chm_cache_unlink(struct chmCacheTable *t, Int32 entry)
+{
+    Int32 *link = &t->buckets[t->entries[entry].block &
+                              (t->num_buckets - 1)];
+    while (*link != entry)
+        link = &t->entries[*link].next;
+    CHM_STORE_RELAXED(*link, t->entries[entry].next);
+}
+
+/* add a copy of a decompressed block to the cache, in an unused entry or
+ * in place of the CLOCK victim.  must have cache_mutex.
+ */
+static void _chm_cache_insert(struct chmFile *h,
+                              UInt64 block,
+                              const UChar *data,
+                              int referenced)
+{
+    struct chmCacheTable *t = h->cache;
+    struct chmCacheEntry *e;
+    Int32 i = _chm_cache_find(t, block);
+
+    if (i != -1)
     {
-        chm_close(newHandle);
-        return NULL;
+        if (referenced)
+            CHM_STORE_RELAXED(t->entries[i].referenced, 1);
+        return;
     }
+    if (t == NULL  ||  t->max_blocks == 0)
+        return;
 
-    /* grab essential information from ITSP header */
-    newHandle->dir_offset += itspHeader.header_len;
-    newHandle->dir_len    -= itspHeader.header_len;
-    newHandle->index_root  = itspHeader.index_root;
-    newHandle->index_head  = itspHeader.index_head;
-    newHandle->block_len   = itspHeader.block_len;
-
-    /* if the index root is -1, this means we don't have any PMGI blocks.
-     * as a result, we must use the sole PMGL block as the index root
+    /* use a fresh entry while under budget, and while there is memory
+     * for it
      */
-    if (newHandle->index_root <= -1)
-        newHandle->index_root = newHandle->index_head;
-
-    /* By default, compression is enabled. */
-    newHandle->compression_enabled = 1;
-
-/* Jed, Sun Jun 27: 'span' doesn't seem to be used anywhere?! */
-#if 0
-    /* fetch span */
-    if (CHM_RESOLVE_SUCCESS != chm_resolve_object(newHandle,
-                                                  _CHMU_SPANINFO,
-                                                  &uiSpan)                ||
-        uiSpan.space == CHM_COMPRESSED)
+    if (t->num_blocks < t->max_blocks)
     {
-        chm_close(newHandle);
-        return NULL;
+        Int32 chunk = t->num_blocks / CHM_CACHE_CHUNK_BLOCKS;
+        Int32 blocks = t->max_blocks - chunk*CHM_CACHE_CHUNK_BLOCKS;
+
+        if (blocks > CHM_CACHE_CHUNK_BLOCKS)
+            blocks = CHM_CACHE_CHUNK_BLOCKS;
+        if (t->chunks[chunk] == NULL)
+            t->chunks[chunk] = (UChar *)malloc((size_t)blocks *
+                                               _chm_block_len(h));
+        if (t->chunks[chunk] != NULL)
+        {
+            e = &t->entries[t->num_blocks];
+            e->seq = 0;
+            e->data = t->chunks[chunk] +
+                      (size_t)(t->num_blocks % CHM_CACHE_CHUNK_BLOCKS) *
+                      _chm_block_len(h);
+            i = t->num_blocks++;
+        }
     }
 
-    /* N.B.: we've already checked that uiSpan is in the uncompressed section,
-     *       so this should not require attempting to decompress, which may
-     *       rely on having a valid "span"
-     */
-    sremain = 8;
-    sbufpos = sbuffer;
-    if (chm_retrieve_object(newHandle, &uiSpan, sbuffer,
-                            0, sremain) != sremain                        ||
-        !_unmarshal_uint64(&sbufpos, &sremain, &newHandle->span))
+    /* otherwise, sweep for an entry not referenced since the last pass */
+    if (i == -1)
     {
-        chm_close(newHandle);
-        return NULL;
+        if (t->num_blocks == 0)
+            return;
+        for (;;)
+        {
+            e = &t->entries[t->hand];
+            i = t->hand;
+            t->hand = (t->hand + 1) % t->num_blocks;
+            if (! CHM_LOAD_RELAXED(e->referenced))
+                break;
+            CHM_STORE_RELAXED(e->referenced, 0);
+        }
+        _chm_cache_unlink(t, i);
+        ++h->cache_evictions;
     }
-#endif
 
-    /* prefetch most commonly needed unit infos */
-    if (CHM_RESOLVE_SUCCESS != chm_resolve_object(newHandle,
-                                                  _CHMU_RESET_TABLE,
-                                                  &newHandle->rt_unit)    ||
+    /* rewrite the entry, with seq odd throughout, then publish it */
+    e = &t->entries[i];
+    CHM_STORE_RELAXED(e->seq, e->seq + 1);
+    CHM_FENCE_RELEASE();
+    CHM_STORE_RELAXED(e->block, block);
+    CHM_STORE_RELAXED(e->referenced, referenced);
+    memcpy(e->data, data, (size_t)_chm_block_len(h));
+    CHM_STORE_RELAXED(e->next, t->buckets[block & (t->num_buckets - 1)]);
+    CHM_STORE_RELEASE(e->seq, e->seq + 1);
+    CHM_STORE_RELEASE(t->buckets[block & (t->num_buckets - 1)], i);
+}
+
+/* pick a counter by where the caller's stack is */
+static struct chmHitCounter *_chm_cache_counter(struct chmFile *h)
+{
+    int here;
+    size_t slot = ((size_t)&here >> 12) * 0x9e3779b1;
+
+    return &h->cache_hits[(slot >> 16) % CHM_HIT_COUNTERS];
+}
+
+#ifdef CHM_LOCKFREE_CACHE
+/* copy part of a cached block out of a table without taking cache_mutex.
+ * Returns 0 if the block was not found, or was being rewritten while we
+ * looked.
+ */
+static int _chm_cache_read_table(struct chmCacheTable *t,
+                                 UInt64 block,
+                                 UChar *buf,
+                                 UInt64 offset,
+                                 UInt64 len)
+{
+    struct chmCacheEntry *e;
+    UInt32 seq;
+    Int32 i, steps;
+
+    if (t == NULL  ||  t->num_buckets == 0)
+        return 0;
+
+    /* walk the chain; a chain which changes under us may not end, so give
+     * up after as many steps as there are entries
+     */
+    i = CHM_LOAD_ACQUIRE(t->buckets[block & (t->num_buckets - 1)]);
+    for (steps = 0; i != -1  &&  steps < t->max_blocks; steps++)
+    {
+        e = &t->entries[i];
+        seq = CHM_LOAD_ACQUIRE(e->seq);
+        if (seq & 1)
+            return 0;
+
+        /* a writer may race this memcpy; the seq check below throws away
+         * a torn copy.  C11 would have the bytes read through atomics, but
+         * that costs a third of the hit rate, and on the targets with the
+         * __atomic builtins a racing read just sees old or new bytes.
+         */
+        if (CHM_LOAD_RELAXED(e->block) == block)
+        {
+            memcpy(buf, e->data + offset, (size_t)len);
+            CHM_FENCE_ACQUIRE();
+            if (CHM_LOAD_RELAXED(e->seq) != seq)
+                return 0;
+            if (! CHM_LOAD_RELAXED(e->referenced))
+                CHM_STORE_RELAXED(e->referenced, 1);
+            return 1;
+        }
+
+        i = CHM_LOAD_RELAXED(e->next);
+        CHM_FENCE_ACQUIRE();
+        if (CHM_LOAD_RELAXED(e->seq) != seq)
+            return 0;
+    }
+    return 0;
+}
+
+/* the same, on whichever table is current, counted as a reader of it so
+ * that a resize does not free it under us
+ */
+static int _chm_cache_read_lockfree(struct chmFile *h,
+                                    UInt64 block,
+                                    UChar *buf,
+                                    UInt64 offset,
+                                    UInt64 len)
+{
+    struct chmHitCounter *c = _chm_cache_counter(h);
+    int found;
+
+    CHM_ADD_SEQ_CST(c->readers, 1);
+    found = _chm_cache_read_table(CHM_LOAD_SEQ_CST(h->cache),
+                                  block, buf, offset, len);
+    CHM_ADD_SEQ_CST(c->readers, (UInt64)-1);
+    if (found)
+        CHM_ADD_RELAXED(c->hits, 1);
+    return found;
+}
+#endif
+
+/* copy part of a cached block out; returns 0 if it is not cached */
+static int _chm_cache_read(struct chmFile *h,
+                           UInt64 block,
+                           UChar *buf,
+                           UInt64 offset,
+                           UInt64 len)
+{
+    Int32 i;
+
+#ifdef CHM_LOCKFREE_CACHE
+    if (_chm_cache_read_lockfree(h, block, buf, offset, len))
+        return 1;
+#endif
+
+    /* fall back on the lock, which also settles whether this is a miss */
+    CHM_ACQUIRE_LOCK(h->cache_mutex);
+    i = _chm_cache_find(h->cache, block);
+    if (i == -1)
+    {
+        ++h->cache_misses;
+        CHM_RELEASE_LOCK(h->cache_mutex);
+        return 0;
+    }
+    CHM_STORE_RELAXED(h->cache->entries[i].referenced, 1);
+    memcpy(buf, h->cache->entries[i].data + offset, (size_t)len);
+    CHM_RELEASE_LOCK(h->cache_mutex);
+    CHM_ADD_RELAXED(_chm_cache_counter(h)->hits, 1);
+    return 1;
+}
+
+/*
+ * the process-wide block cache, shared by all handles opened with
+ * CHM_OPEN_SHARED_CACHE.  Blocks are keyed on (file identity, block index)
+ * and spread over several independently locked stripes; each stripe gets
+ * an equal share of the memory budget, and replaces its blocks in CLOCK
+ * order.  Data is only ever copied out under the stripe lock.
+ */
+struct chmSharedEntry
+{
+    struct chmFileId        id;
+    UInt64                  block;
+    UInt32                  len;
+    int                     referenced;         /* CLOCK reference bit    */
+    struct chmSharedEntry  *next;               /* hash chain             */
+    struct chmSharedEntry  *clock_prev;         /* CLOCK ring             */
+    struct chmSharedEntry  *clock_next;
+};
+
+struct chmSharedStripe
+{
+#ifdef CHM_MT
+#ifdef WIN32
+    CRITICAL_SECTION        mutex;
+#else
+    pthread_mutex_t         mutex;
+#endif
+#endif
+    struct chmSharedEntry  *buckets[CHM_SHARED_CACHE_BUCKETS];
+    struct chmSharedEntry  *hand;
+    UInt64                  blocks;
+    UInt64                  bytes;
+    UInt64                  max_bytes;
+    UInt64                  hits;
+    UInt64                  misses;
+    UInt64                  evictions;
+};
+
+static struct chmSharedStripe _chm_shared_stripes[CHM_SHARED_CACHE_STRIPES];
+
+static void _chm_shared_init_stripes(void)
+{
+    int i;
+    for (i=0; i<CHM_SHARED_CACHE_STRIPES; i++)
+    {
+#ifdef CHM_MT
+#ifdef WIN32
+        InitializeCriticalSection(&_chm_shared_stripes[i].mutex);
+#else
+        pthread_mutex_init(&_chm_shared_stripes[i].mutex, NULL);
+#endif
+#endif
+        _chm_shared_stripes[i].max_bytes =
+                    CHM_SHARED_CACHE_BYTES / CHM_SHARED_CACHE_STRIPES;
+    }
+}
+
+static UInt64 _chm_shared_hash(const struct chmFileId *id, UInt64 block)
+{
+    UInt64 x = id->dev;
+    x = x * 0x9e3779b1 + id->ino;
+    x = x * 0x9e3779b1 + id->size;
+    x = x * 0x9e3779b1 + id->mtime;
+    x = x * 0x9e3779b1 + id->mtime_ns;
+    x = x * 0x9e3779b1 + block;
+    x ^= x >> 29;
+    x *= 0x85ebca6b;
+    x ^= x >> 32;
+    return x;
+}
+
+static struct chmSharedEntry **_chm_shared_bucket(const struct chmFileId *id,
+                                                  UInt64 block,
+                                                  struct chmSharedStripe **stripe)
+{
+    UInt64 x = _chm_shared_hash(id, block);
+    *stripe = &_chm_shared_stripes[x % CHM_SHARED_CACHE_STRIPES];
+    return &(*stripe)->buckets[(x / CHM_SHARED_CACHE_STRIPES) %
+                               CHM_SHARED_CACHE_BUCKETS];
+}
+
+/* find a block in a stripe.  must have the stripe's mutex */
+static struct chmSharedEntry *_chm_shared_find(struct chmSharedEntry *e,
+                                               const struct chmFileId *id,
+                                               UInt64 block)
+{
+    while (e != NULL  &&
+           (e->block != block  ||  memcmp(&e->id, id, sizeof(*id)) != 0))
+        e = e->next;
+    return e;
+}
+
+/* drop an entry from a stripe.  must have the stripe's mutex */
+static void _chm_shared_evict(struct chmSharedStripe *stripe,
+                              struct chmSharedEntry *e)
+{
+    struct chmSharedEntry **link;
+    UInt64 x = _chm_shared_hash(&e->id, e->block);
+
+    link = &stripe->buckets[(x / CHM_SHARED_CACHE_STRIPES) %
+                            CHM_SHARED_CACHE_BUCKETS];
+    while (*link != e)
+        link = &(*link)->next;
+    *link = e->next;
+
+    if (e->clock_next == e)
+        stripe->hand = NULL;
+    else
+    {
+        e->clock_prev->clock_next = e->clock_next;
+        e->clock_next->clock_prev = e->clock_prev;
+        if (stripe->hand == e)
+            stripe->hand = e->clock_next;
+    }
+    --stripe->blocks;
+    stripe->bytes -= e->len;
+    free(e);
+}
+
+/* copy part of a shared block out; returns 0 if it is not cached */
+static int _chm_shared_lookup(const struct chmFileId *id,
+                              UInt64 block,
+                              UChar *buf,
+                              UInt64 offset,
+                              UInt64 len)
+{
+    struct chmSharedStripe *stripe;
+    struct chmSharedEntry **bucket = _chm_shared_bucket(id, block, &stripe);
+    struct chmSharedEntry *e;
+
+    CHM_ACQUIRE_LOCK(stripe->mutex);
+    e = _chm_shared_find(*bucket, id, block);
+    if (e == NULL  ||  offset + len > e->len)
+    {
+        ++stripe->misses;
+        CHM_RELEASE_LOCK(stripe->mutex);
+        return 0;
+    }
+    e->referenced = 1;
+    ++stripe->hits;
+    memcpy(buf, (UChar *)(e + 1) + offset, (size_t)len);
+    CHM_RELEASE_LOCK(stripe->mutex);
+    return 1;
+}
+
+/* publish a freshly decompressed block */
+static void _chm_shared_insert(const struct chmFileId *id,
+                               UInt64 block,
+                               const UChar *data,
+                               UInt32 len,
+                               int referenced)
+{
+    struct chmSharedStripe *stripe;
+    struct chmSharedEntry **bucket = _chm_shared_bucket(id, block, &stripe);
+    struct chmSharedEntry *e;
+
+    CHM_ACQUIRE_LOCK(stripe->mutex);
+    e = _chm_shared_find(*bucket, id, block);
+    if (e != NULL)
+    {
+        e->referenced |= referenced;
+        CHM_RELEASE_LOCK(stripe->mutex);
+        return;
+    }
+    if (len > stripe->max_bytes)
+    {
+        CHM_RELEASE_LOCK(stripe->mutex);
+        return;
+    }
+
+    /* sweep for entries not referenced since the last pass */
+    while (stripe->bytes + len > stripe->max_bytes)
+    {
+        e = stripe->hand;
+        if (e->referenced)
+        {
+            e->referenced = 0;
+            stripe->hand = e->clock_next;
+        }
+        else
+        {
+            _chm_shared_evict(stripe, e);
+            ++stripe->evictions;
+        }
+    }
+
+    e = (struct chmSharedEntry *)malloc(sizeof(struct chmSharedEntry) + len);
+    if (e == NULL)
+    {
+        CHM_RELEASE_LOCK(stripe->mutex);
+        return;
+    }
+    e->id = *id;
+    e->block = block;
+    e->len = len;
+    e->referenced = referenced;
+    memcpy(e + 1, data, len);
+
+    e->next = *bucket;
+    *bucket = e;
+
+    /* new entries go just behind the hand, so they are swept last */
+    if (stripe->hand == NULL)
+    {
+        e->clock_prev = e->clock_next = e;
+        stripe->hand = e;
+    }
+    else
+    {
+        e->clock_next = stripe->hand;
+        e->clock_prev = stripe->hand->clock_prev;
+        e->clock_prev->clock_next = e;
+        stripe->hand->clock_prev = e;
+    }
+    ++stripe->blocks;
+    stripe->bytes += len;
+    CHM_RELEASE_LOCK(stripe->mutex);
+}
+
+/* find out what identifies the file behind a handle; 0 on failure */
+static int _chm_file_identity(struct chmFile *h, struct chmFileId *id)
+{
+#ifdef WIN32
+    BY_HANDLE_FILE_INFORMATION info;
+
+    if (! GetFileInformationByHandle(h->fd, &info))
+        return 0;
+    id->dev   = info.dwVolumeSerialNumber;
+    id->ino   = ((UInt64)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    id->size  = ((UInt64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    id->mtime = ((UInt64)info.ftLastWriteTime.dwHighDateTime << 32) |
+                info.ftLastWriteTime.dwLowDateTime;
+    id->mtime_ns = 0;
+#else
+    struct stat st;
+
+    if (fstat(h->fd, &st) != 0)
+        return 0;
+    id->dev   = (UInt64)st.st_dev;
+    id->ino   = (UInt64)st.st_ino;
+    id->size  = (UInt64)st.st_size;
+    id->mtime = (UInt64)st.st_mtime;
+
+    /* a file rewritten within the second must not match */
+#if defined(__APPLE__)  &&  !defined(_POSIX_C_SOURCE)
+    id->mtime_ns = (UInt64)st.st_mtimespec.tv_nsec;
+#elif defined(__APPLE__)
+    id->mtime_ns = (UInt64)st.st_mtimensec;
+#elif defined(st_mtime)
+    /* st_mtime is st_mtim.tv_sec wherever there is st_mtim */
+    id->mtime_ns = (UInt64)st.st_mtim.tv_nsec;
+#else
+    id->mtime_ns = 0;
+#endif
+#endif
+    return 1;
+}
+
+/* get a pointer to len bytes at offset os of a mapped file; NULL if the
+ * file is not mapped or the range is out of bounds
+ */
+static UChar *_chm_map_bytes(struct chmFile *h,
+                             UInt64 os,
+                             Int64 len)
+{
+    if (h->map == NULL  ||  len < 0  ||
+        os > h->map_len  ||  (UInt64)len > h->map_len - os)
+        return NULL;
+    return h->map + os;
+}
+
+/* map the whole file into memory; leaves the handle unmapped on failure */
+static void _chm_map_file(struct chmFile *h)
+{
+#ifdef CHM_USE_MMAP
+    struct stat st;
+    void *map;
+
+    if (fstat(h->fd, &st) != 0  ||  st.st_size <= 0  ||
+        (UInt64)st.st_size != (UInt64)(size_t)st.st_size)
+        return;
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, h->fd, 0);
+    if (map == MAP_FAILED)
+        return;
+
+    h->map = (UChar *)map;
+    h->map_len = (UInt64)st.st_size;
+#endif
+}
+
+/* read the whole reset table into memory.  Called with lzx_mutex held, or
+ * before the handle is handed out.  On failure, rt_state is left at -1 and
+ * the table is read an entry at a time instead.
+ */
+static void _chm_load_reset_table(struct chmFile *h)
+{
+    UInt64 tableStart = (UInt64)h->data_offset
+                        + (UInt64)h->rt_unit.start
+                        + (UInt64)h->reset_table.table_offset;
+    UInt64 tableLen = (UInt64)h->reset_table.block_count * 8;
+    UChar *table, *dummy;
+    unsigned int remain;
+    UInt32 i;
+
+    h->rt_state = -1;
+    if (h->reset_table.block_count == 0                                      ||
+        (UInt64)h->reset_table.table_offset + tableLen > h->rt_unit.length  ||
+        tableLen != (UInt64)(unsigned int)tableLen)
+        return;
+
+    h->rt_offsets = (UInt64 *)malloc(((size_t)h->reset_table.block_count + 1)
+                                     * sizeof(UInt64));
+    if (h->rt_offsets == NULL)
+        return;
+
+    /* read it straight out of the mapping if we can */
+    table = _chm_map_bytes(h, tableStart, tableLen);
+    if (table == NULL)
+    {
+        table = (UChar *)h->rt_offsets;
+        if (_chm_fetch_bytes(h, table, tableStart, tableLen) != (Int64)tableLen)
+        {
+            free(h->rt_offsets);
+            h->rt_offsets = NULL;
+            return;
+        }
+    }
+
+    /* unmarshal in place: each entry is exactly as wide as its source */
+    dummy = table;
+    remain = (unsigned int)tableLen;
+    for (i=0; i<h->reset_table.block_count; i++)
+        _unmarshal_uint64(&dummy, &remain, &h->rt_offsets[i]);
+    h->rt_offsets[i] = h->reset_table.compressed_len;
+    h->rt_state = 1;
+}
+
+/*
+ * the process-wide pool of LZX decoder states.  A decoder left idle gives
+ * its state (the window and the decoding tables) back, and takes one from
+ * here, or a new one, when it is next needed; the pool keeps states up to
+ * a memory budget, by window size, for any handle to reuse.  Decoders are
+ * found idle by searching the list of open handles.  Lock order: the list,
+ * then a handle's lzx_mutex, then the pool.
+ */
+#define CHM_WINDOW_SIZES 7                      /* 2^15 to 2^21 bytes     */
+
+struct chmPooledState
+{
+    struct LZXstate        *state;
+    UInt64                  size;
+    struct chmPooledState  *next;
+};
+
+struct chmWindowPool
+{
+#ifdef CHM_MT
+#ifdef WIN32
+    CRITICAL_SECTION        mutex;
+#else
+    pthread_mutex_t         mutex;
+#endif
+#endif
+    struct chmPooledState  *states[CHM_WINDOW_SIZES];
+    UInt64                  bytes;
+    UInt64                  max_bytes;
+};
+
+struct chmHandleList
+{
+#ifdef CHM_MT
+#ifdef WIN32
+    CRITICAL_SECTION        mutex;
+#else
+    pthread_mutex_t         mutex;
+#endif
+#endif
+    struct chmFile         *head;
+    UInt64                  idle_ms;            /* 0 keeps decoders       */
+    UInt64                  next_search;        /* in ms                  */
+};
+
+#ifdef CHM_MT
+/*
+ * the process-wide pool of worker threads for parallel jobs.  Threads are
+ * started as jobs first want them, up to CHM_MAX_WORKERS, and then wait
+ * for more work rather than exit.
+ */
+struct chmTask
+{
+    void                  (*fn)(void *);
+    void                   *arg;
+    int                     running;
+    struct chmTask         *next;               /* while queued           */
+};
+
+struct chmWorkerPool
+{
+#ifdef WIN32
+    CRITICAL_SECTION        mutex;
+    CONDITION_VARIABLE      queued;
+    CONDITION_VARIABLE      finished;
+#else
+    pthread_mutex_t         mutex;
+    pthread_cond_t          queued;
+    pthread_cond_t          finished;
+#endif
+    struct chmTask         *head;
+    struct chmTask         *tail;
+    int                     threads;
+    int                     idle;
+};
+#endif
+
+static struct chmWindowPool _chm_window_pool;
+static struct chmHandleList _chm_open_handles;
+#ifdef CHM_MT
+static struct chmWorkerPool _chm_workers;
+#endif
+
+static void _chm_global_setup(void)
+{
+    _chm_shared_init_stripes();
+#ifdef CHM_MT
+#ifdef WIN32
+    InitializeCriticalSection(&_chm_window_pool.mutex);
+    InitializeCriticalSection(&_chm_open_handles.mutex);
+    InitializeCriticalSection(&_chm_workers.mutex);
+    InitializeConditionVariable(&_chm_workers.queued);
+    InitializeConditionVariable(&_chm_workers.finished);
+#else
+    pthread_mutex_init(&_chm_window_pool.mutex, NULL);
+    pthread_mutex_init(&_chm_open_handles.mutex, NULL);
+    pthread_mutex_init(&_chm_workers.mutex, NULL);
+    pthread_cond_init(&_chm_workers.queued, NULL);
+    pthread_cond_init(&_chm_workers.finished, NULL);
+#endif
+#endif
+    _chm_window_pool.max_bytes = CHM_WINDOW_POOL_BYTES;
+    _chm_open_handles.idle_ms = CHM_DECODER_IDLE_MS;
+}
+
+/* set up the shared cache, the pools and the list the first time they are
+ * needed
+ */
+#if defined(CHM_MT) && !defined(WIN32)
+static pthread_once_t _chm_global_once = PTHREAD_ONCE_INIT;
+static void _chm_global_init(void)
+{
+    pthread_once(&_chm_global_once, _chm_global_setup);
+}
+#elif defined(CHM_MT)
+static void _chm_global_init(void)
+{
+    static volatile LONG state = 0;
+    if (InterlockedCompareExchange(&state, 1, 0) == 0)
+    {
+        _chm_global_setup();
+        InterlockedExchange(&state, 2);
+    }
+    else
+    {
+        while (state != 2)
+            Sleep(0);
+    }
+}
+#else
+static void _chm_global_init(void)
+{
+    static int initialized = 0;
+    if (! initialized)
+    {
+        _chm_global_setup();
+        initialized = 1;
+    }
+}
+#endif
+
+/* a clock for idle decoders, in milliseconds */
+static UInt64 _chm_clock_ms(void)
+{
+#ifdef WIN32
+    return (UInt64)GetTickCount64();
+#else
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        return 0;
+    return (UInt64)ts.tv_sec * 1000 + (UInt64)ts.tv_nsec / 1000000;
+#endif
+}
+
+/* take a state for the given window size from the pool, reset, or make a
+ * new one
+ */
+static struct LZXstate *_chm_get_state(int window_bits)
+{
+    struct chmPooledState *p;
+    struct LZXstate *state;
+
+    if (window_bits < 15  ||  window_bits >= 15 + CHM_WINDOW_SIZES)
+        return NULL;
+
+    CHM_ACQUIRE_LOCK(_chm_window_pool.mutex);
+    p = _chm_window_pool.states[window_bits - 15];
+    if (p != NULL)
+    {
+        _chm_window_pool.states[window_bits - 15] = p->next;
+        _chm_window_pool.bytes -= p->size;
+    }
+    CHM_RELEASE_LOCK(_chm_window_pool.mutex);
+
+    if (p == NULL)
+        return LZXinit(window_bits);
+    state = p->state;
+    free(p);
+    LZXreset(state);
+    return state;
+}
+
+/* give a state back to the pool, or free it if the pool is full */
+static void _chm_put_state(int window_bits, struct LZXstate *state)
+{
+    struct chmPooledState *p;
+    UInt64 size = LZXstatesize(state);
+
+    p = (struct chmPooledState *)malloc(sizeof(struct chmPooledState));
+    if (p != NULL)
+    {
+        p->state = state;
+        p->size = size;
+        CHM_ACQUIRE_LOCK(_chm_window_pool.mutex);
+        if (_chm_window_pool.bytes + size <= _chm_window_pool.max_bytes)
+        {
+            p->next = _chm_window_pool.states[window_bits - 15];
+            _chm_window_pool.states[window_bits - 15] = p;
+            _chm_window_pool.bytes += size;
+            state = NULL;
+        }
+        CHM_RELEASE_LOCK(_chm_window_pool.mutex);
+    }
+    if (state != NULL)
+    {
+        free(p);
+        LZXteardown(state);
+    }
+}
+
+/* free every pooled state.  must have the pool's mutex. */
+static void _chm_empty_window_pool(void)
+{
+    int i;
+    for (i=0; i<CHM_WINDOW_SIZES; i++)
+    {
+        while (_chm_window_pool.states[i] != NULL)
+        {
+            struct chmPooledState *p = _chm_window_pool.states[i];
+            _chm_window_pool.states[i] = p->next;
+            LZXteardown(p->state);
+            free(p);
+        }
+    }
+    _chm_window_pool.bytes = 0;
+}
+
+/*
+ * the decoder pool
+ */
+
+static void _chm_free_decoder(struct chmFile *h, struct chmDecoder *d)
+{
+#ifdef CHM_MT
+#ifdef WIN32
+    DeleteCriticalSection(&d->mutex);
+#else
+    pthread_mutex_destroy(&d->mutex);
+#endif
+#endif
+    if (d->state)
+        _chm_put_state(ffs(h->window_size) - 1, d->state);
+    free(d->buffer);
+    free(d->cbuffer);
+    free(d->span.data);
+    free(d);
+}
+
+/* change the size of the decoder pool.  Decoders dropped while in use are
+ * freed by their last user.  must have lzx_mutex.
+ */
+static void _chm_resize_decoders(struct chmFile *h, Int32 numDecoders)
+{
+    struct chmDecoder **decoders;
+    Int32 i;
+
+    for (i=numDecoders; i<h->num_decoders; i++)
+    {
+        struct chmDecoder *d = h->decoders[i];
+        if (d == NULL)
+            continue;
+        if (d->users == 0)
+            _chm_free_decoder(h, d);
+        else
+            d->retired = 1;
+    }
+    if (numDecoders == 0)
+    {
+        free(h->decoders);
+        h->decoders = NULL;
+        h->num_decoders = 0;
+        return;
+    }
+    if (numDecoders < h->num_decoders)
+    {
+        h->num_decoders = numDecoders;
+        return;
+    }
+
+    decoders = (struct chmDecoder **)realloc(h->decoders,
+                            numDecoders * sizeof(struct chmDecoder *));
+    if (decoders == NULL)
+        return;
+    for (i=h->num_decoders; i<numDecoders; i++)
+        decoders[i] = NULL;
+    h->decoders = decoders;
+    h->num_decoders = numDecoders;
+}
+
+/* pick a decoder for a block, and wait for it to be free.  In order of
+ * preference: an idle decoder which is already within the block's reset
+ * interval, the idle decoder used longest ago, a new decoder, and finally
+ * the busy decoder with the fewest users, preferring one headed for the
+ * block's reset interval.  New decoders are only started while every other
+ * is busy, so a single thread never has more than one.
+ */
+static struct chmDecoder *_chm_acquire_decoder(struct chmFile *h,
+                                               UInt64 block)
+{
+    UInt64 interval = block / h->reset_blkcount;
+    struct chmDecoder *d, *best = NULL;
+    int bestRank = 0, rank;
+    Int32 i, fresh = -1;
+
+    CHM_ACQUIRE_LOCK(h->lzx_mutex);
+
+    /* the whole reset table is wanted sooner or later */
+    if (h->rt_state == 0)
+        _chm_load_reset_table(h);
+
+    for (i=0; i<h->num_decoders; i++)
+    {
+        d = h->decoders[i];
+        if (d == NULL)
+        {
+            if (fresh == -1)
+                fresh = i;
+            continue;
+        }
+
+        if (d->users == 0)
+        {
+            if (d->last_block != -1                          &&
+                (UInt64)d->last_block <= block               &&
+                (UInt64)d->last_block / h->reset_blkcount == interval)
+                rank = 4;
+            else
+                rank = 2;
+        }
+        else if (d->next_block <= block  &&
+                 d->next_block / h->reset_blkcount == interval)
+            rank = 1;
+        else
+            rank = 0;
+
+        if (best == NULL                                                ||
+            rank > bestRank                                             ||
+            (rank == bestRank  &&  rank >= 2  &&
+             (rank == 4 ? d->last_block > best->last_block
+                        : d->last_used < best->last_used))              ||
+            (rank == bestRank  &&  rank < 2  &&  d->users < best->users))
+        {
+            best = d;
+            bestRank = rank;
+        }
+    }
+
+    /* start a new decoder rather than wait for one that is in use */
+    if (fresh != -1  &&  bestRank < 2)
+    {
+        d = (struct chmDecoder *)malloc(sizeof(struct chmDecoder));
+        if (d != NULL)
+        {
+#ifdef CHM_MT
+#ifdef WIN32
+            InitializeCriticalSection(&d->mutex);
+#else
+            pthread_mutex_init(&d->mutex, NULL);
+#endif
+#endif
+            d->state = NULL;
+            d->last_block = -1;
+            d->data = NULL;
+            d->buffer = NULL;
+            d->cbuffer = NULL;
+            memset(&d->span, 0, sizeof(d->span));
+            d->users = 0;
+            d->idle_since = 0;
+            d->retired = 0;
+            h->decoders[fresh] = best = d;
+        }
+    }
+
+    if (best != NULL)
+    {
+        ++best->users;
+        best->next_block = block;
+        best->last_used = ++h->decoder_clock;
+    }
+    CHM_RELEASE_LOCK(h->lzx_mutex);
+
+    if (best != NULL)
+    {
+        CHM_ACQUIRE_LOCK(best->mutex);
+    }
+    return best;
+}
+
+/* free the decoders of every open handle which have been idle since before
+ * the cutoff, their states going back to the pool.  The next read that
+ * needs one starts a new decoder, which replays from the reset point or a
+ * checkpoint.  must have the list's mutex.
+ */
+static void _chm_release_idle(UInt64 cutoff)
+{
+    struct chmFile *h;
+    Int32 i;
+
+    for (h = _chm_open_handles.head; h != NULL; h = h->next_open)
+    {
+        CHM_ACQUIRE_LOCK(h->lzx_mutex);
+        for (i=0; i<h->num_decoders; i++)
+        {
+            struct chmDecoder *d = h->decoders[i];
+            if (d != NULL  &&  d->users == 0  &&  d->idle_since <= cutoff)
+            {
+                h->decoders[i] = NULL;
+                _chm_free_decoder(h, d);
+            }
+        }
+        CHM_RELEASE_LOCK(h->lzx_mutex);
+    }
+}
+
+/* look for idle decoders, at most every half timeout */
+static void _chm_search_idle(UInt64 now)
+{
+    UInt64 idle;
+
+    CHM_ACQUIRE_LOCK(_chm_open_handles.mutex);
+    idle = _chm_open_handles.idle_ms;
+    if (idle != 0  &&  now >= _chm_open_handles.next_search  &&  now > idle)
+    {
+        CHM_STORE_RELAXED(_chm_open_handles.next_search, now + idle / 2 + 1);
+        _chm_release_idle(now - idle);
+    }
+    CHM_RELEASE_LOCK(_chm_open_handles.mutex);
+}
+
+static void _chm_release_decoder(struct chmFile *h, struct chmDecoder *d)
+{
+    UInt64 now = 0;
+
+    CHM_RELEASE_LOCK(d->mutex);
+
+    if (CHM_LOAD_RELAXED(_chm_open_handles.idle_ms) != 0)
+        now = _chm_clock_ms();
+
+    CHM_ACQUIRE_LOCK(h->lzx_mutex);
+    if (--d->users == 0)
+    {
+        if (d->retired)
+            _chm_free_decoder(h, d);
+        else
+            d->idle_since = now;
+    }
+    CHM_RELEASE_LOCK(h->lzx_mutex);
+
+    if (now != 0  &&  now >= CHM_LOAD_RELAXED(_chm_open_handles.next_search))
+        _chm_search_idle(now);
+}
+
+/*
+ * decoder checkpoints
+ */
+
+static void _chm_drop_checkpoint(struct chmFile *h, Int32 i)
+{
+    struct chmCheckpoint *c = h->checkpoints[i];
+
+    h->checkpoint_bytes -= c->size;
+    h->checkpoints[i] = h->checkpoints[--h->num_checkpoints];
+    if (c->users == 0)
+    {
+        LZXfreecheckpoint(c->state);
+        free(c);
+    }
+    else
+        c->dropped = 1;
+}
+
+/* drop the least recently used checkpoints until they fit in the budget.
+ * must have lzx_mutex.
+ */
+static void _chm_trim_checkpoints(struct chmFile *h)
+{
+    while (h->checkpoint_bytes > h->checkpoint_budget)
+    {
+        Int32 i, lru = 0;
+        for (i=1; i<h->num_checkpoints; i++)
+            if (h->checkpoints[i]->last_used < h->checkpoints[lru]->last_used)
+                lru = i;
+        _chm_drop_checkpoint(h, lru);
+    }
+}
+
+/* find the latest checkpoint at or after block from, and before block to;
+ * it must be handed back with _chm_put_checkpoint.
+ */
+static struct chmCheckpoint *_chm_get_checkpoint(struct chmFile *h,
+                                                 UInt64 from,
+                                                 UInt64 to)
+{
+    struct chmCheckpoint *best = NULL;
+    Int32 i;
+
+    CHM_ACQUIRE_LOCK(h->lzx_mutex);
+    for (i=0; i<h->num_checkpoints; i++)
+    {
+        struct chmCheckpoint *c = h->checkpoints[i];
+        if (c->block >= from  &&  c->block < to  &&
+            (best == NULL  ||  c->block > best->block))
+            best = c;
+    }
+    if (best != NULL)
+    {
+        ++best->users;
+        best->last_used = ++h->decoder_clock;
+    }
+    CHM_RELEASE_LOCK(h->lzx_mutex);
+    return best;
+}
+
+static void _chm_put_checkpoint(struct chmFile *h, struct chmCheckpoint *c)
+{
+    (void)h;
+    CHM_ACQUIRE_LOCK(h->lzx_mutex);
+    if (--c->users == 0  &&  c->dropped)
+    {
+        LZXfreecheckpoint(c->state);
+        free(c);
+    }
+    CHM_RELEASE_LOCK(h->lzx_mutex);
+}
+
+/* save a decoder's state after it has decompressed a block, if the block
+ * is due a checkpoint and has none yet.  must have the decoder's mutex.
+ */
+static void _chm_save_checkpoint(struct chmFile *h,
+                                 struct chmDecoder *d,
+                                 UInt64 block)
+{
+    struct chmCheckpoint *c;
+    struct LZXcheckpoint *state;
+    UInt64 size;
+    Int32 i;
+
+    /* none at the end of an interval: the next block starts afresh */
+    if ((block + 1) % h->reset_blkcount == 0)
+        return;
+
+    CHM_ACQUIRE_LOCK(h->lzx_mutex);
+    if (h->checkpoint_budget == 0  ||
+        ((block % h->reset_blkcount) + 1) % h->checkpoint_interval != 0)
+    {
+        CHM_RELEASE_LOCK(h->lzx_mutex);
+        return;
+    }
+    for (i=0; i<h->num_checkpoints; i++)
+    {
+        if (h->checkpoints[i]->block == block)
+        {
+            CHM_RELEASE_LOCK(h->lzx_mutex);
+            return;
+        }
+    }
+    CHM_RELEASE_LOCK(h->lzx_mutex);
+
+    /* the copy is taken without the lock; another thread may beat us to it,
+     * which is checked again below
+     */
+    state = LZXcheckpoint(d->state);
+    if (state == NULL)
+        return;
+    size = sizeof(struct chmCheckpoint) + LZXcheckpointsize(state);
+
+    CHM_ACQUIRE_LOCK(h->lzx_mutex);
+    for (i=0; i<h->num_checkpoints; i++)
+        if (h->checkpoints[i]->block == block)
+            break;
+    if (i < h->num_checkpoints  ||  size > h->checkpoint_budget)
+    {
+        CHM_RELEASE_LOCK(h->lzx_mutex);
+        LZXfreecheckpoint(state);
+        return;
+    }
+
+    /* make room for it, then add it */
+    h->checkpoint_bytes += size;
+    _chm_trim_checkpoints(h);
+    h->checkpoint_bytes -= size;
+    {
+        struct chmCheckpoint **checkpoints = (struct chmCheckpoint **)realloc(
+                h->checkpoints,
+                (h->num_checkpoints + 1) * sizeof(struct chmCheckpoint *));
+        c = (struct chmCheckpoint *)malloc(sizeof(struct chmCheckpoint));
+        if (checkpoints != NULL)
+            h->checkpoints = checkpoints;
+        if (checkpoints == NULL  ||  c == NULL)
+        {
+            CHM_RELEASE_LOCK(h->lzx_mutex);
+            free(c);
+            LZXfreecheckpoint(state);
+            return;
+        }
+    }
+    c->block = block;
+    c->state = state;
+    c->size = size;
+    c->last_used = ++h->decoder_clock;
+    c->users = 0;
+    c->dropped = 0;
+    h->checkpoints[h->num_checkpoints++] = c;
+    h->checkpoint_bytes += size;
+    CHM_RELEASE_LOCK(h->lzx_mutex);
+}
+
+/* open an ITS archive */
+#ifdef PPC_BSTR
+/* RWE 6/12/2003 */
+struct chmFile *chm_open(BSTR filename)
+{
+    return chm_open_ex(filename, 0);
+}
+#else
+struct chmFile *chm_open(const char *filename)
+{
+    return chm_open_ex(filename, 0);
+}
+#endif
+
+/* open an ITS archive, with flags */
+#ifdef PPC_BSTR
+struct chmFile *chm_open_ex(BSTR filename, int flags)
+#else
+struct chmFile *chm_open_ex(const char *filename, int flags)
+#endif
+{
+    unsigned char               sbuffer[256];
+    unsigned int                sremain;
+    unsigned char              *sbufpos;
+    struct chmFile             *newHandle=NULL;
+    struct chmItsfHeader        itsfHeader;
+    struct chmItspHeader        itspHeader;
+#if 0
+    struct chmUnitInfo          uiSpan;
+#endif
+    struct chmUnitInfo          uiLzxc;
+    struct chmLzxcControlData   ctlData;
+
+    /* allocate handle */
+    newHandle = (struct chmFile *)malloc(sizeof(struct chmFile));
+    if (newHandle == NULL)
+        return NULL;
+    newHandle->fd = CHM_NULL_FD;
+    newHandle->map = NULL;
+    newHandle->map_len = 0;
+    newHandle->decoders = NULL;
+    newHandle->num_decoders = 0;
+    newHandle->decoder_clock = 0;
+    newHandle->checkpoints = NULL;
+    newHandle->num_checkpoints = 0;
+    newHandle->checkpoint_bytes = 0;
+    newHandle->checkpoint_budget = CHM_CHECKPOINT_BYTES;
+    newHandle->checkpoint_interval = CHM_CHECKPOINT_INTERVAL;
+    newHandle->parallel_decode = CHM_PARALLEL_DECODE;
+    newHandle->cache = NULL;
+    memset(newHandle->cache_hits, 0, sizeof(newHandle->cache_hits));
+    newHandle->cache_misses = 0;
+    newHandle->cache_evictions = 0;
+    newHandle->shared_cache = 0;
+    newHandle->rt_offsets = NULL;
+    newHandle->rt_state = 0;
+    newHandle->cache_dir_pages = NULL;
+    newHandle->cache_num_dir_pages = 0;
+    newHandle->num_scratch = 0;
+    newHandle->prev_open = NULL;
+    newHandle->next_open = NULL;
+    newHandle->listed = 0;
+
+    /* open file */
+#ifdef WIN32
+#ifdef PPC_BSTR
+    if ((newHandle->fd=CreateFile(filename,
+                                  GENERIC_READ,
+                                  FILE_SHARE_READ,
+                                  NULL,
+                                  OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL,
+                                  NULL)) == CHM_NULL_FD)
+    {
+        free(newHandle);
+        return NULL;
+    }
+#else
+    if ((newHandle->fd=CreateFileA(filename,
+                                   GENERIC_READ,
+                                   0,
+                                   NULL,
+                                   OPEN_EXISTING,
+                                   FILE_ATTRIBUTE_NORMAL,
+                                   NULL)) == CHM_NULL_FD)
+    {
+        free(newHandle);
+        return NULL;
+    }
+#endif
+#else
+    if ((newHandle->fd=open(filename, O_RDONLY)) == CHM_NULL_FD)
+    {
+        free(newHandle);
+        return NULL;
+    }
+#endif
+
+    /* map the file, if asked to; fall back to plain reads if we can't */
+    if (flags & CHM_OPEN_MMAP)
+        _chm_map_file(newHandle);
+
+    /* join the shared block cache, if asked to */
+    if (flags & CHM_OPEN_SHARED_CACHE)
+    {
+        _chm_global_init();
+        newHandle->shared_cache = _chm_file_identity(newHandle,
+                                                     &newHandle->file_id);
+    }
+
+    /* initialize mutexes, if needed */
+#ifdef CHM_MT
+#ifdef WIN32
+    InitializeCriticalSection(&newHandle->mutex);
+    InitializeCriticalSection(&newHandle->lzx_mutex);
+    InitializeCriticalSection(&newHandle->cache_mutex);
+    InitializeCriticalSection(&newHandle->dir_mutex);
+#else
+    pthread_mutex_init(&newHandle->mutex, NULL);
+    pthread_mutex_init(&newHandle->lzx_mutex, NULL);
+    pthread_mutex_init(&newHandle->cache_mutex, NULL);
+    pthread_mutex_init(&newHandle->dir_mutex, NULL);
+#endif
+#endif
+
+    /* read and verify header */
+    sremain = _CHM_ITSF_V3_LEN;
+    sbufpos = sbuffer;
+    if (_chm_fetch_bytes(newHandle, sbuffer, (UInt64)0, sremain) != sremain    ||
+        !_unmarshal_itsf_header(&sbufpos, &sremain, &itsfHeader))
+    {
+        chm_close(newHandle);
+        return NULL;
+    }
+
+    /* stash important values from header */
+    newHandle->dir_offset  = itsfHeader.dir_offset;
+    newHandle->dir_len     = itsfHeader.dir_len;
+    newHandle->data_offset = itsfHeader.data_offset;
+
+    /* now, read and verify the directory header chunk */
+    sremain = _CHM_ITSP_V1_LEN;
+    sbufpos = sbuffer;
+    if (_chm_fetch_bytes(newHandle, sbuffer,
+                         (UInt64)itsfHeader.dir_offset, sremain) != sremain       ||
+        !_unmarshal_itsp_header(&sbufpos, &sremain, &itspHeader))
+    {
+        chm_close(newHandle);
+        return NULL;
+    }
+
+    /* grab essential information from ITSP header */
+    newHandle->dir_offset += itspHeader.header_len;
+    newHandle->dir_len    -= itspHeader.header_len;
+    newHandle->index_root  = itspHeader.index_root;
+    newHandle->index_head  = itspHeader.index_head;
+    newHandle->block_len   = itspHeader.block_len;
+    newHandle->scratch_len = newHandle->block_len;
+
+    /* one quickref entry is stored for every 1+2^n directory entries; an
+     * absurd density simply disables the quickref lookups
+     */
+    if (itspHeader.blockidx_intvl >= 0  &&  itspHeader.blockidx_intvl < 16)
+        newHandle->qr_density = 1 + (1 << itspHeader.blockidx_intvl);
+    else
+        newHandle->qr_density = 0;
+
+    /* initialize directory page cache */
+    chm_set_param(newHandle, CHM_PARAM_MAX_DIR_PAGES_CACHED,
+                  CHM_MAX_DIR_PAGES_CACHED);
+
+    /* if the index root is -1, this means we don't have any PMGI blocks.
+     * as a result, we must use the sole PMGL block as the index root
+     */
+    if (newHandle->index_root <= -1)
+        newHandle->index_root = newHandle->index_head;
+
+    /* By default, compression is enabled. */
+    newHandle->compression_enabled = 1;
+
+/* Jed, Sun Jun 27: 'span' doesn't seem to be used anywhere?! */
+#if 0
+    /* fetch span */
+    if (CHM_RESOLVE_SUCCESS != chm_resolve_object(newHandle,
+                                                  _CHMU_SPANINFO,
+                                                  &uiSpan)                ||
+        uiSpan.space == CHM_COMPRESSED)
+    {
+        chm_close(newHandle);
+        return NULL;
+    }
+
+    /* N.B.: we've already checked that uiSpan is in the uncompressed section,
+     *       so this should not require attempting to decompress, which may
+     *       rely on having a valid "span"
+     */
+    sremain = 8;
+    sbufpos = sbuffer;
+    if (chm_retrieve_object(newHandle, &uiSpan, sbuffer,
+                            0, sremain) != sremain                        ||
+        !_unmarshal_uint64(&sbufpos, &sremain, &newHandle->span))
+    {
+        chm_close(newHandle);
+        return NULL;
+    }
+#endif
+
+    /* prefetch most commonly needed unit infos */
+    if (CHM_RESOLVE_SUCCESS != chm_resolve_object(newHandle,
+                                                  _CHMU_RESET_TABLE,
+                                                  &newHandle->rt_unit)    ||
         newHandle->rt_unit.space == CHM_COMPRESSED                        ||
         CHM_RESOLVE_SUCCESS != chm_resolve_object(newHandle,
                                                   _CHMU_CONTENT,
@@ -955,9 +2607,37 @@ struct chmFile *chm_open(const char *filename)
 #endif
     }
 
-    /* initialize cache */
+    /* load the reset table now, if asked to */
+    if ((flags & CHM_OPEN_PRELOAD_RESET_TABLE)  &&
+        newHandle->compression_enabled)
+        _chm_load_reset_table(newHandle);
+
+    /* initialize cache; with the shared cache, there is no need for a
+     * private one
+     */
     chm_set_param(newHandle, CHM_PARAM_MAX_BLOCKS_CACHED,
-                  CHM_MAX_BLOCKS_CACHED);
+                  newHandle->shared_cache ? 0 : CHM_MAX_BLOCKS_CACHED);
+
+    /* scratch buffers borrowed so far only had room for a directory page */
+    _chm_free_scratch(newHandle);
+    newHandle->scratch_len = _chm_block_len(newHandle);
+    if (newHandle->scratch_len < newHandle->block_len)
+        newHandle->scratch_len = newHandle->block_len;
+
+    /* initialize decoder pool */
+    chm_set_param(newHandle, CHM_PARAM_MAX_DECODERS, CHM_MAX_DECODERS);
+
+    /* let its decoders be released once idle */
+    _chm_global_init();
+    CHM_ACQUIRE_LOCK(_chm_open_handles.mutex);
+    newHandle->next_open = _chm_open_handles.head;
+    if (_chm_open_handles.head != NULL)
+        _chm_open_handles.head->prev_open = newHandle;
+    _chm_open_handles.head = newHandle;
+    newHandle->listed = 1;
+    CHM_RELEASE_LOCK(_chm_open_handles.mutex);
+    if (CHM_LOAD_RELAXED(_chm_open_handles.idle_ms) != 0)
+        _chm_search_idle(_chm_clock_ms());
 
     return newHandle;
 }
@@ -965,8 +2645,29 @@ struct chmFile *chm_open(const char *filename)
 /* close an ITS archive */
 void chm_close(struct chmFile *h)
 {
+    Int32 i;
+
     if (h != NULL)
     {
+        if (h->listed)
+        {
+            CHM_ACQUIRE_LOCK(_chm_open_handles.mutex);
+            if (h->prev_open != NULL)
+                h->prev_open->next_open = h->next_open;
+            else
+                _chm_open_handles.head = h->next_open;
+            if (h->next_open != NULL)
+                h->next_open->prev_open = h->prev_open;
+            CHM_RELEASE_LOCK(_chm_open_handles.mutex);
+        }
+
+#ifdef CHM_USE_MMAP
+        if (h->map != NULL)
+            munmap(h->map, (size_t)h->map_len);
+#endif
+        h->map = NULL;
+        h->map_len = 0;
+
         if (h->fd != CHM_NULL_FD)
             CHM_CLOSE_FILE(h->fd);
         h->fd = CHM_NULL_FD;
@@ -976,32 +2677,34 @@ void chm_close(struct chmFile *h)
         DeleteCriticalSection(&h->mutex);
         DeleteCriticalSection(&h->lzx_mutex);
         DeleteCriticalSection(&h->cache_mutex);
+        DeleteCriticalSection(&h->dir_mutex);
 #else
         pthread_mutex_destroy(&h->mutex);
         pthread_mutex_destroy(&h->lzx_mutex);
         pthread_mutex_destroy(&h->cache_mutex);
+        pthread_mutex_destroy(&h->dir_mutex);
 #endif
 #endif
 
-        if (h->lzx_state)
-            LZXteardown(h->lzx_state);
-        h->lzx_state = NULL;
+        _chm_resize_decoders(h, 0);
 
-        if (h->cache_blocks)
-        {
-            int i;
-            for (i=0; i<h->cache_num_blocks; i++)
-            {
-                if (h->cache_blocks[i])
-                    free(h->cache_blocks[i]);
-            }
-            free(h->cache_blocks);
-            h->cache_blocks = NULL;
-        }
+        h->checkpoint_budget = 0;
+        _chm_trim_checkpoints(h);
+        free(h->checkpoints);
+        h->checkpoints = NULL;
+
+        _chm_cache_free(h);
+        _chm_free_scratch(h);
+
+        if (h->rt_offsets)
+            free(h->rt_offsets);
+        h->rt_offsets = NULL;
 
-        if (h->cache_block_indices)
-            free(h->cache_block_indices);
-        h->cache_block_indices = NULL;
+        for (i=0; i<h->cache_num_dir_pages; i++)
+            free(h->cache_dir_pages[i]);
+        if (h->cache_dir_pages)
+            free(h->cache_dir_pages);
+        h->cache_dir_pages = NULL;
 
         free(h);
     }
@@ -1011,10 +2714,41 @@ void chm_close(struct chmFile *h)
  * set a parameter on the file handle.
  * valid parameter types:
  *          CHM_PARAM_MAX_BLOCKS_CACHED:
- *                 how many decompressed blocks should be cached?  A simple
- *                 caching scheme is used, wherein the index of the block is
+ *                 how many decompressed blocks should be cached?  Blocks are
+ *                 evicted in CLOCK order (an approximation of LRU) once the
+ *                 cache is full.  Resizing the cache empties it.  Memory
+ *                 for blocks is only allocated as they are cached.
+ *          CHM_PARAM_BLOCK_CACHE_BYTES:
+ *                 the same, given as a memory budget in bytes.
+ *          CHM_PARAM_MAX_DECODERS:
+ *                 how many LZX decoders may run at once on this file?  Each
+ *                 has its own window, allocated on first use and given back
+ *                 once idle (see chm_set_decoder_timeout).  Reads in
+ *                 different reset intervals decompress in parallel when
+ *                 there are enough decoders for them.
+ *          CHM_PARAM_PARALLEL_DECODE:
+ *                 how many threads may a single read be decoded on?  Only
+ *                 reads spanning CHM_PARALLEL_MIN_INTERVALS reset intervals
+ *                 or more are split, an interval at a time, and never over
+ *                 more threads than there are decoders.  The default, 1,
+ *                 decodes every read on the calling thread.
+ *          CHM_PARAM_CHECKPOINT_BYTES:
+ *                 how much memory may be spent on decoder checkpoints?  A
+ *                 checkpoint saves the decoder (including the used part of
+ *                 its window) part way through a reset interval, so that a
+ *                 seek need not decompress every block since the reset.
+ *                 Zero, the default, disables them.
+ *          CHM_PARAM_CHECKPOINT_INTERVAL:
+ *                 how many blocks apart, within a reset interval, should
+ *                 checkpoints be taken?
+ *          CHM_PARAM_MAX_DIR_PAGES_CACHED:
+ *                 how many directory (PMGL/PMGI) pages should be cached?  A
+ *                 simple caching scheme is used, wherein the page number is
  *                 used as a hash value, and hash collision results in the
- *                 invalidation of the previously cached block.
+ *                 invalidation of the previously cached page.  Zero
+ *                 disables the cache.
+ *          Either cache is held to CHM_MAX_CACHE_BYTES, however large the
+ *          count it is given; counts too large to size are ignored.
  */
 void chm_set_param(struct chmFile *h,
                    int paramType,
@@ -1023,58 +2757,98 @@ void chm_set_param(struct chmFile *h,
     switch (paramType)
     {
         case CHM_PARAM_MAX_BLOCKS_CACHED:
+        case CHM_PARAM_BLOCK_CACHE_BYTES:
+            if (paramVal < 0)
+                break;
+            if (paramType == CHM_PARAM_BLOCK_CACHE_BYTES)
+                paramVal = (int)(paramVal / _chm_block_len(h));
+
             CHM_ACQUIRE_LOCK(h->cache_mutex);
-            if (paramVal != h->cache_num_blocks)
+            _chm_cache_resize(h, paramVal);
+            CHM_RELEASE_LOCK(h->cache_mutex);
+            break;
+
+        case CHM_PARAM_MAX_DECODERS:
+            if (paramVal < 1)
+                break;
+            CHM_ACQUIRE_LOCK(h->lzx_mutex);
+            _chm_resize_decoders(h, paramVal);
+            CHM_RELEASE_LOCK(h->lzx_mutex);
+            break;
+
+        case CHM_PARAM_CHECKPOINT_BYTES:
+            if (paramVal < 0)
+                break;
+            CHM_ACQUIRE_LOCK(h->lzx_mutex);
+            h->checkpoint_budget = (UInt64)paramVal;
+            _chm_trim_checkpoints(h);
+            CHM_RELEASE_LOCK(h->lzx_mutex);
+            break;
+
+        case CHM_PARAM_PARALLEL_DECODE:
+            if (paramVal < 1)
+                break;
+            CHM_STORE_RELAXED(h->parallel_decode, paramVal);
+            break;
+
+        case CHM_PARAM_CHECKPOINT_INTERVAL:
+            if (paramVal < 1)
+                break;
+            CHM_ACQUIRE_LOCK(h->lzx_mutex);
+            h->checkpoint_interval = (UInt32)paramVal;
+            CHM_RELEASE_LOCK(h->lzx_mutex);
+            break;
+
+        case CHM_PARAM_MAX_DIR_PAGES_CACHED:
+            paramVal = _chm_cache_cap(paramVal, (UInt64)h->block_len
+                                                + sizeof(struct chmDirPage)
+                                                + sizeof(struct chmDirPage *));
+            if (paramVal < 0)
+                break;
+            CHM_ACQUIRE_LOCK(h->dir_mutex);
+            if (paramVal != h->cache_num_dir_pages)
             {
-                UChar **newBlocks;
-                UInt64 *newIndices;
+                struct chmDirPage **newPages = NULL;
                 int     i;
 
-                /* allocate new cached blocks */
-                newBlocks = (UChar **)malloc(paramVal * sizeof (UChar *));
-                if (newBlocks == NULL) return;
-                newIndices = (UInt64 *)malloc(paramVal * sizeof (UInt64));
-                if (newIndices == NULL) { free(newBlocks); return; }
-                for (i=0; i<paramVal; i++)
+                /* allocate new slots; the pages themselves are allocated
+                 * as they are first cached
+                 */
+                if (paramVal > 0)
                 {
-                    newBlocks[i] = NULL;
-                    newIndices[i] = 0;
-                }
-
-                /* re-distribute old cached blocks */
-                if (h->cache_blocks)
-                {
-                    for (i=0; i<h->cache_num_blocks; i++)
+                    newPages = (struct chmDirPage **)calloc(
+                            (size_t)paramVal, sizeof(struct chmDirPage *));
+                    if (newPages == NULL)
                     {
-                        int newSlot = (int)(h->cache_block_indices[i] % paramVal);
-
-                        if (h->cache_blocks[i])
-                        {
-                            /* in case of collision, destroy newcomer */
-                            if (newBlocks[newSlot])
-                            {
-                                free(h->cache_blocks[i]);
-                                h->cache_blocks[i] = NULL;
-                            }
-                            else
-                            {
-                                newBlocks[newSlot] = h->cache_blocks[i];
-                                newIndices[newSlot] =
-                                            h->cache_block_indices[i];
-                            }
-                        }
+                        CHM_RELEASE_LOCK(h->dir_mutex);
+                        break;
                     }
+                }
 
-                    free(h->cache_blocks);
-                    free(h->cache_block_indices);
+                /* re-distribute old cached pages */
+                for (i=0; i<h->cache_num_dir_pages; i++)
+                {
+                    struct chmDirPage *page = h->cache_dir_pages[i];
+
+                    if (page == NULL)
+                        continue;
+
+                    /* in case of collision, destroy newcomer */
+                    if (paramVal > 0  &&
+                        newPages[page->page % paramVal] == NULL)
+                        newPages[page->page % paramVal] = page;
+                    else if (page->users > 0)
+                        page->dropped = 1;
+                    else
+                        free(page);
                 }
+                free(h->cache_dir_pages);
 
                 /* now, set new values */
-                h->cache_blocks = newBlocks;
-                h->cache_block_indices = newIndices;
-                h->cache_num_blocks = paramVal;
+                h->cache_dir_pages = newPages;
+                h->cache_num_dir_pages = paramVal;
             }
-            CHM_RELEASE_LOCK(h->cache_mutex);
+            CHM_RELEASE_LOCK(h->dir_mutex);
             break;
 
         default:
@@ -1082,10 +2856,218 @@ void chm_set_param(struct chmFile *h,
     }
 }
 
+/* get statistics about the decompressed block cache */
+void chm_get_cache_stats(struct chmFile *h,
+                         struct chmCacheStats *stats)
+{
+    int i;
+
+    CHM_ACQUIRE_LOCK(h->cache_mutex);
+    memset(stats, 0, sizeof(*stats));
+    for (i=0; i<CHM_HIT_COUNTERS; i++)
+        stats->hits   += CHM_LOAD_RELAXED(h->cache_hits[i].hits);
+    stats->misses      = h->cache_misses;
+    stats->evictions   = h->cache_evictions;
+    if (h->cache != NULL)
+    {
+        stats->blocks      = h->cache->num_blocks;
+        stats->max_blocks  = h->cache->max_blocks;
+    }
+    stats->block_len   = _chm_block_len(h);
+    stats->bytes       = stats->blocks * stats->block_len;
+    stats->max_bytes   = stats->max_blocks * stats->block_len;
+    CHM_RELEASE_LOCK(h->cache_mutex);
+}
+
+/* get statistics about the decoders */
+void chm_get_decoder_stats(struct chmFile *h,
+                           struct chmDecoderStats *stats)
+{
+    Int32 i;
+
+    memset(stats, 0, sizeof(*stats));
+    CHM_ACQUIRE_LOCK(h->lzx_mutex);
+    for (i=0; i<h->num_decoders; i++)
+        if (h->decoders[i] != NULL)
+            ++stats->decoders;
+    stats->max_decoders     = h->num_decoders;
+    stats->checkpoints      = h->num_checkpoints;
+    stats->checkpoint_bytes = h->checkpoint_bytes;
+    CHM_RELEASE_LOCK(h->lzx_mutex);
+}
+
+/* set the memory budget of the shared block cache; this empties it */
+void chm_set_shared_cache(LONGUINT64 maxBytes)
+{
+    int i;
+
+    _chm_global_init();
+    for (i=0; i<CHM_SHARED_CACHE_STRIPES; i++)
+    {
+        struct chmSharedStripe *stripe = &_chm_shared_stripes[i];
+
+        CHM_ACQUIRE_LOCK(stripe->mutex);
+        while (stripe->hand != NULL)
+            _chm_shared_evict(stripe, stripe->hand);
+        stripe->max_bytes = maxBytes / CHM_SHARED_CACHE_STRIPES;
+        CHM_RELEASE_LOCK(stripe->mutex);
+    }
+}
+
+/* get statistics about the shared block cache */
+void chm_get_shared_cache_stats(struct chmCacheStats *stats)
+{
+    int i;
+
+    _chm_global_init();
+    memset(stats, 0, sizeof(*stats));
+    for (i=0; i<CHM_SHARED_CACHE_STRIPES; i++)
+    {
+        struct chmSharedStripe *stripe = &_chm_shared_stripes[i];
+
+        CHM_ACQUIRE_LOCK(stripe->mutex);
+        stats->hits      += stripe->hits;
+        stats->misses    += stripe->misses;
+        stats->evictions += stripe->evictions;
+        stats->blocks    += stripe->blocks;
+        stats->bytes     += stripe->bytes;
+        stats->max_bytes += stripe->max_bytes;
+        CHM_RELEASE_LOCK(stripe->mutex);
+    }
+}
+
+/* set how long decoders may be idle before they give up their windows */
+void chm_set_decoder_timeout(unsigned int idleMillis)
+{
+    _chm_global_init();
+    CHM_ACQUIRE_LOCK(_chm_open_handles.mutex);
+    CHM_STORE_RELAXED(_chm_open_handles.idle_ms, (UInt64)idleMillis);
+    CHM_STORE_RELAXED(_chm_open_handles.next_search, 0);
+    CHM_RELEASE_LOCK(_chm_open_handles.mutex);
+}
+
+/* set the memory budget of the window pool; this empties it */
+void chm_set_window_pool(LONGUINT64 maxBytes)
+{
+    _chm_global_init();
+    CHM_ACQUIRE_LOCK(_chm_window_pool.mutex);
+    _chm_empty_window_pool();
+    _chm_window_pool.max_bytes = maxBytes;
+    CHM_RELEASE_LOCK(_chm_window_pool.mutex);
+}
+
+/* release every idle decoder now, and empty the window pool */
+void chm_release_idle_decoders(void)
+{
+    _chm_global_init();
+    CHM_ACQUIRE_LOCK(_chm_open_handles.mutex);
+    _chm_release_idle((UInt64)-1);
+    CHM_RELEASE_LOCK(_chm_open_handles.mutex);
+
+    CHM_ACQUIRE_LOCK(_chm_window_pool.mutex);
+    _chm_empty_window_pool();
+    CHM_RELEASE_LOCK(_chm_window_pool.mutex);
+}
+
 /*
  * helper methods for chm_resolve_object
  */
 
+/* fetch a directory page.  Pages of mapped files are returned from the
+ * mapping, and pages in the page cache are returned in place, held in
+ * *held until passed to _chm_release_dir_page.  Other pages are read into
+ * *buf, a scratch buffer taken on first need, and then added to the cache
+ * if populate is set.  Takes dir_mutex only to look in the cache and to
+ * add to it, never for the read.  Returns NULL on failure.
+ */
+static UChar *_chm_fetch_dir_page(struct chmFile *h,
+                                  Int32 page,
+                                  UChar **buf,
+                                  int populate,
+                                  struct chmDirPage **held)
+{
+    struct chmDirPage *cached, **slot;
+
+    *held = NULL;
+    if (page < 0)
+        return NULL;
+
+    /* mapped files need no cache */
+    if (h->map != NULL)
+        return _chm_map_bytes(h,
+                              (UInt64)h->dir_offset + (UInt64)page*h->block_len,
+                              h->block_len);
+
+    /* check the page cache */
+    CHM_ACQUIRE_LOCK(h->dir_mutex);
+    if (h->cache_num_dir_pages > 0)
+    {
+        cached = h->cache_dir_pages[page % h->cache_num_dir_pages];
+        if (cached != NULL  &&  cached->page == page)
+        {
+            ++cached->users;
+            CHM_RELEASE_LOCK(h->dir_mutex);
+            *held = cached;
+            return cached->data;
+        }
+    }
+    CHM_RELEASE_LOCK(h->dir_mutex);
+
+    /* read the page */
+    if (*buf == NULL)
+        *buf = _chm_get_scratch(h);
+    if (*buf == NULL  ||
+        _chm_fetch_bytes(h, *buf,
+                         (UInt64)h->dir_offset + (UInt64)page*h->block_len,
+                         h->block_len) != h->block_len)
+        return NULL;
+
+    /* add it to the cache, over the page in its slot unless that one is
+     * in use
+     */
+    if (populate)
+    {
+        CHM_ACQUIRE_LOCK(h->dir_mutex);
+        if (h->cache_num_dir_pages > 0)
+        {
+            slot = &h->cache_dir_pages[page % h->cache_num_dir_pages];
+            cached = *slot;
+            if (cached == NULL  ||  cached->users > 0)
+            {
+                cached = (struct chmDirPage *)malloc(
+                        sizeof(struct chmDirPage) + (size_t)h->block_len);
+                if (cached != NULL  &&  *slot != NULL)
+                    (*slot)->dropped = 1;
+            }
+            if (cached != NULL)
+            {
+                cached->page = page;
+                cached->users = 0;
+                cached->dropped = 0;
+                memcpy(cached->data, *buf, h->block_len);
+                *slot = cached;
+            }
+        }
+        CHM_RELEASE_LOCK(h->dir_mutex);
+    }
+    return *buf;
+}
+
+/* let go of a page from _chm_fetch_dir_page, freeing it if it has been
+ * replaced meanwhile
+ */
+static void _chm_release_dir_page(struct chmFile *h, struct chmDirPage *page)
+{
+    (void)h;
+    if (page == NULL)
+        return;
+    CHM_ACQUIRE_LOCK(h->dir_mutex);
+    if (--page->users > 0  ||  ! page->dropped)
+        page = NULL;
+    CHM_RELEASE_LOCK(h->dir_mutex);
+    free(page);
+}
+
 /* skip a compressed dword */
 static void _chm_skip_cword(UChar **pEntry)
 {
@@ -1155,44 +3137,153 @@ static int _chm_parse_PMGL_entry(UChar **pEntry, struct chmUnitInfo *ui)
     return 1;
 }
 
+/* compare a directory entry name with a path, in the manner of strcasecmp */
+static int _chm_compare_name(const UChar *name,
+                             UInt64 nameLen,
+                             const char *objPath)
+{
+    const UChar *path = (const UChar *)objPath;
+    int c1, c2;
+
+    while (nameLen != 0  &&  *path != '\0')
+    {
+        c1 = tolower(*name++);
+        c2 = tolower(*path++);
+        if (c1 != c2)
+            return c1 - c2;
+        --nameLen;
+    }
+
+    if (nameLen != 0)
+        return 1;
+    return (*path != '\0') ? -1 : 0;
+}
+
+/* is a name pure ASCII?  Entries are only known to be sorted the way
+ * _chm_compare_name compares them when they are; writers differ in how
+ * they order other names.
+ */
+static int _chm_is_ascii(const UChar *name, UInt64 nameLen)
+{
+    while (nameLen-- != 0)
+        if (*name++ & 0x80)
+            return 0;
+    return 1;
+}
+
+/* fetch quickref slot n, counting backwards from the end of a page */
+static UInt32 _chm_quickref_slot(const UChar *qr, UInt32 n)
+{
+    qr -= 2 + 2*(size_t)n;
+    return qr[0] | qr[1]<<8;
+}
+
+/*
+ * use the quickref area at the end of a directory page to find the run of
+ * entries which may hold objPath.  The last word of the page holds the
+ * number of entries, and is preceded (growing backwards) by the offsets of
+ * every qr_density-th entry, relative to the first one.  Returns the first
+ * entry of the run, which is the first entry of the page if the quickref
+ * area is missing or looks bogus, or if a name involved is not ASCII.
+ * Building with CHM_QUICKREF 0 ignores the area, to measure against.
+ */
+static UChar *_chm_quickref_seek(UChar *page_buf,
+                                 UInt32 block_len,
+                                 UInt32 qr_density,
+                                 UChar *entries,
+                                 UChar *end,
+                                 const char *objPath)
+{
+    UChar *qr = page_buf + block_len;
+    UChar *cur;
+    UInt32 num_entries;
+    UInt32 lo, hi, mid;
+    UInt64 strLen;
+
+    if (! CHM_QUICKREF  ||  qr_density == 0  ||  end + 2 > qr  ||
+        ! _chm_is_ascii((const UChar *)objPath, strlen(objPath)))
+        return entries;
+    num_entries = _chm_quickref_slot(qr, 0);
+    if (num_entries == 0)
+        return entries;
+
+    /* slot 0 holds the count, and entry 0 needs no slot of its own */
+    hi = (num_entries - 1) / qr_density;
+    if (end + 2 + 2*(size_t)hi > qr)
+        return entries;
+
+    /* binary search for the last run starting at or before objPath */
+    lo = 0;
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        cur = entries + _chm_quickref_slot(qr, mid);
+        if (cur >= end)
+            return entries;
+
+        strLen = _chm_parse_cword(&cur);
+        if (strLen > CHM_MAX_PATHLEN  ||  cur + strLen > end  ||
+            ! _chm_is_ascii(cur, strLen))
+            return entries;
+
+        if (_chm_compare_name(cur, strLen, objPath) > 0)
+            hi = mid - 1;
+        else
+            lo = mid;
+    }
+
+    if (lo == 0)
+        return entries;
+    return entries + _chm_quickref_slot(qr, lo);
+}
+
 /* find an exact entry in PMGL; return NULL if we fail */
 static UChar *_chm_find_in_PMGL(UChar *page_buf,
                          UInt32 block_len,
+                         UInt32 qr_density,
                          const char *objPath)
 {
-    /* XXX: modify this to do a binary search using the nice index structure
-     *      that is provided for us.
-     */
     struct chmPmglHeader header;
     unsigned int hremain;
     UChar *end;
     UChar *cur;
     UChar *temp;
     UInt64 strLen;
-    char buffer[CHM_MAX_PATHLEN+1];
+    int cmp, ascii;
 
     /* figure out where to start and end */
     cur = page_buf;
     hremain = _CHM_PMGL_LEN;
     if (! _unmarshal_pmgl_header(&cur, &hremain, &header))
         return NULL;
+    if (header.free_space > block_len - _CHM_PMGL_LEN)
+        return NULL;
     end = page_buf + block_len - (header.free_space);
 
-    /* now, scan progressively */
+    /* skip ahead to the run of entries which may hold the name */
+    cur = _chm_quickref_seek(page_buf, block_len, qr_density,
+                             cur, end, objPath);
+
+    /* now, scan progressively; entries are sorted, so stop once past it,
+     * unless either name is outside ASCII, where the order is not known
+     */
+    ascii = _chm_is_ascii((const UChar *)objPath, strlen(objPath));
     while (cur < end)
     {
         /* grab the name */
         temp = cur;
         strLen = _chm_parse_cword(&cur);
-        if (strLen > CHM_MAX_PATHLEN)
-            return NULL;
-        if (! _chm_parse_UTF8(&cur, strLen, buffer))
+        if (strLen > CHM_MAX_PATHLEN  ||  cur + strLen > end)
             return NULL;
 
         /* check if it is the right name */
-        if (! strcasecmp(buffer, objPath))
+        cmp = _chm_compare_name(cur, strLen, objPath);
+        if (cmp == 0)
             return temp;
+        if (cmp > 0  &&  ascii  &&  _chm_is_ascii(cur, strLen))
+            return NULL;
 
+        cur += strLen;
         _chm_skip_PMGL_entry_data(&cur);
     }
 
@@ -1202,114 +3293,319 @@ static UChar *_chm_find_in_PMGL(UChar *page_buf,
 /* find which block should be searched next for the entry; -1 if no block */
 static Int32 _chm_find_in_PMGI(UChar *page_buf,
                         UInt32 block_len,
+                        UInt32 qr_density,
                         const char *objPath)
 {
-    /* XXX: modify this to do a binary search using the nice index structure
-     *      that is provided for us
-     */
     struct chmPmgiHeader header;
     unsigned int hremain;
     int page=-1;
     UChar *end;
     UChar *cur;
     UInt64 strLen;
-    char buffer[CHM_MAX_PATHLEN+1];
 
     /* figure out where to start and end */
     cur = page_buf;
     hremain = _CHM_PMGI_LEN;
     if (! _unmarshal_pmgi_header(&cur, &hremain, &header))
         return -1;
+    if (header.free_space > block_len - _CHM_PMGI_LEN)
+        return -1;
     end = page_buf + block_len - (header.free_space);
 
+    /* skip ahead to the run of entries which may hold the name */
+    cur = _chm_quickref_seek(page_buf, block_len, qr_density,
+                             cur, end, objPath);
+
     /* now, scan progressively */
     while (cur < end)
     {
         /* grab the name */
         strLen = _chm_parse_cword(&cur);
-        if (strLen > CHM_MAX_PATHLEN)
-            return -1;
-        if (! _chm_parse_UTF8(&cur, strLen, buffer))
+        if (strLen > CHM_MAX_PATHLEN  ||  cur + strLen > end)
             return -1;
 
         /* check if it is the right name */
-        if (strcasecmp(buffer, objPath) > 0)
+        if (_chm_compare_name(cur, strLen, objPath) > 0)
             return page;
 
         /* load next value for path */
+        cur += strLen;
         page = (int)_chm_parse_cword(&cur);
     }
 
-    return page;
+    return page;
+}
+
+/* resolve a particular object from the archive */
+int chm_resolve_object(struct chmFile *h,
+                       const char *objPath,
+                       struct chmUnitInfo *ui)
+{
+    Int32 curPage;
+    UChar *page;
+    struct chmDirPage *held;
+    int result = CHM_RESOLVE_FAILURE;
+
+    /* buffer to hold whatever page we're looking at, if it is neither
+     * mapped nor cached; taken on first need
+     */
+    /* RWE 6/12/2003 */
+    UChar *page_buf = NULL;
+
+    /* starting page */
+    curPage = h->index_root;
+
+    /* until we have either returned or given up */
+    while (curPage != -1)
+    {
+
+        /* try to fetch the index page */
+        page = _chm_fetch_dir_page(h, curPage, &page_buf, 1, &held);
+        if (page == NULL)
+            break;
+
+        /* now, if it is a leaf node: */
+        if (memcmp(page, _chm_pmgl_marker, 4) == 0)
+        {
+            /* scan block */
+            UChar *pEntry = _chm_find_in_PMGL(page,
+                                              h->block_len,
+                                              h->qr_density,
+                                              objPath);
+
+            /* parse entry and return */
+            if (pEntry != NULL)
+            {
+                _chm_parse_PMGL_entry(&pEntry, ui);
+                result = CHM_RESOLVE_SUCCESS;
+            }
+            curPage = -1;
+        }
+
+        /* else, if it is a branch node: */
+        else if (memcmp(page, _chm_pmgi_marker, 4) == 0)
+            curPage = _chm_find_in_PMGI(page, h->block_len,
+                                        h->qr_density, objPath);
+
+        /* else, we are confused.  give up. */
+        else
+            curPage = -1;
+
+        _chm_release_dir_page(h, held);
+    }
+
+    _chm_put_scratch(h, page_buf);
+    return result;
 }
 
-/* resolve a particular object from the archive */
-int chm_resolve_object(struct chmFile *h,
-                       const char *objPath,
-                       struct chmUnitInfo *ui)
+/* a path to be resolved by chm_resolve_objects */
+struct chmBatchPath
 {
-    /*
-     * XXX: implement caching scheme for dir pages
-     */
+    const char         *path;
+    int                 index;          /* where the caller wants it      */
+};
 
-    Int32 curPage;
+static int _chm_compare_batch_paths(const void *a, const void *b)
+{
+    const char *pa = ((const struct chmBatchPath *)a)->path;
+    const char *pb = ((const struct chmBatchPath *)b)->path;
+    return _chm_compare_name((const UChar *)pa, strlen(pa), pb);
+}
 
-    /* buffer to hold whatever page we're looking at */
-    /* RWE 6/12/2003 */
-    UChar *page_buf = malloc(h->block_len);
-    if (page_buf == NULL)
-        return CHM_RESOLVE_FAILURE;
+/* resolve a sorted run of paths beneath a directory page, reading each
+ * page along the way once.
+ */
+static int _chm_resolve_batch(struct chmFile *h,
+                              Int32 curPage,
+                              struct chmBatchPath *paths,
+                              int count,
+                              struct chmUnitInfo *uis,
+                              int *results,
+                              int depth)
+{
+    UChar *page, *page_buf = NULL;
+    struct chmDirPage *held = NULL;
+    UChar *cur, *next, *end;
+    UInt32 free_space;
+    UInt64 strLen;
+    int i, resolved = 0;
 
-    /* starting page */
-    curPage = h->index_root;
+    /* a deeper tree than this is a loop */
+    if (depth > 32)
+        return 0;
 
-    /* until we have either returned or given up */
-    while (curPage != -1)
+    /* fetch the page; each level of the walk needs its own buffer, in
+     * case the page is not cached
+     */
+    page = _chm_fetch_dir_page(h, curPage, &page_buf, 1, &held);
+    if (page == NULL)
+        goto done;
+
+    /* figure out where the entries start and end */
+    if (memcmp(page, _chm_pmgl_marker, 4) == 0)
     {
+        struct chmPmglHeader header;
+        unsigned int hremain = _CHM_PMGL_LEN;
+        cur = page;
+        if (! _unmarshal_pmgl_header(&cur, &hremain, &header)  ||
+            header.free_space > h->block_len - _CHM_PMGL_LEN)
+            goto done;
+        free_space = header.free_space;
+    }
+    else if (memcmp(page, _chm_pmgi_marker, 4) == 0)
+    {
+        struct chmPmgiHeader header;
+        unsigned int hremain = _CHM_PMGI_LEN;
+        cur = page;
+        if (! _unmarshal_pmgi_header(&cur, &hremain, &header)  ||
+            header.free_space > h->block_len - _CHM_PMGI_LEN)
+            goto done;
+        free_space = header.free_space;
+    }
+    else
+        goto done;
+    end = page + h->block_len - free_space;
 
-        /* try to fetch the index page */
-        if (_chm_fetch_bytes(h, page_buf,
-                             (UInt64)h->dir_offset + (UInt64)curPage*h->block_len,
-                             h->block_len) != h->block_len)
+    /* a leaf: walk the entries and the paths together.  Entries before a
+     * path are before every later one too, but the walk only stops short
+     * of the end for a path once past it if both names are ASCII, as for
+     * _chm_find_in_PMGL.
+     */
+    if (memcmp(page, _chm_pmgl_marker, 4) == 0)
+    {
+        UChar *entries = cur, *scan;
+
+        for (i=0; i<count; i++)
         {
-            free(page_buf);
-            return CHM_RESOLVE_FAILURE;
+            int ascii = _chm_is_ascii((const UChar *)paths[i].path,
+                                      strlen(paths[i].path));
+            int behind = 1;
+
+            next = _chm_quickref_seek(page, h->block_len, h->qr_density,
+                                      entries, end, paths[i].path);
+            if (next > cur)
+                cur = next;
+
+            for (scan = cur; scan < end; scan = next)
+            {
+                int cmp;
+
+                next = scan;
+                strLen = _chm_parse_cword(&next);
+                if (strLen > CHM_MAX_PATHLEN  ||  next + strLen > end)
+                    goto done;
+
+                cmp = _chm_compare_name(next, strLen, paths[i].path);
+                if (cmp == 0)
+                {
+                    next = scan;
+                    if (_chm_parse_PMGL_entry(&next, &uis[paths[i].index]))
+                    {
+                        results[paths[i].index] = CHM_RESOLVE_SUCCESS;
+                        ++resolved;
+                    }
+                    break;
+                }
+                if (cmp > 0)
+                {
+                    if (ascii  &&  _chm_is_ascii(next, strLen))
+                        break;
+                    behind = 0;
+                }
+
+                next += strLen;
+                _chm_skip_PMGL_entry_data(&next);
+                if (behind)
+                    cur = next;
+            }
         }
+    }
 
-        /* now, if it is a leaf node: */
-        if (memcmp(page_buf, _chm_pmgl_marker, 4) == 0)
+    /* a branch: send each run of paths which share a child down to it */
+    else
+    {
+        UChar *entries = cur;
+        Int32 child = -1;
+        int j;
+
+        for (i=0; i<count; i=j)
         {
-            /* scan block */
-            UChar *pEntry = _chm_find_in_PMGL(page_buf,
-                                              h->block_len,
-                                              objPath);
-            if (pEntry == NULL)
+            next = _chm_quickref_seek(page, h->block_len, h->qr_density,
+                                      entries, end, paths[i].path);
+            if (next > cur)
+                cur = next;
+
+            /* find the last entry at or before the path */
+            while (cur < end)
             {
-                free(page_buf);
-                return CHM_RESOLVE_FAILURE;
+                next = cur;
+                strLen = _chm_parse_cword(&next);
+                if (strLen > CHM_MAX_PATHLEN  ||  next + strLen > end)
+                    goto done;
+                if (_chm_compare_name(next, strLen, paths[i].path) > 0)
+                    break;
+                next += strLen;
+                child = (Int32)_chm_parse_cword(&next);
+                cur = next;
             }
 
-            /* parse entry and return */
-            _chm_parse_PMGL_entry(&pEntry, ui);
-            free(page_buf);
-            return CHM_RESOLVE_SUCCESS;
+            /* ...and every later path which also comes before the next */
+            j = i + 1;
+            if (cur < end)
+            {
+                next = cur;
+                strLen = _chm_parse_cword(&next);
+                while (j < count  &&
+                       _chm_compare_name(next, strLen, paths[j].path) > 0)
+                    ++j;
+            }
+            else
+                j = count;
+
+            if (child != -1)
+                resolved += _chm_resolve_batch(h, child, paths + i, j - i,
+                                               uis, results, depth + 1);
         }
+    }
 
-        /* else, if it is a branch node: */
-        else if (memcmp(page_buf, _chm_pmgi_marker, 4) == 0)
-            curPage = _chm_find_in_PMGI(page_buf, h->block_len, objPath);
+done:
+    _chm_release_dir_page(h, held);
+    _chm_put_scratch(h, page_buf);
+    return resolved;
+}
 
-        /* else, we are confused.  give up. */
-        else
-        {
-            free(page_buf);
-            return CHM_RESOLVE_FAILURE;
-        }
+/* resolve several objects at once.  The paths are sorted first, so that
+ * each directory page is read at most once for the whole batch.
+ */
+int chm_resolve_objects(struct chmFile *h,
+                        const char **objPaths,
+                        struct chmUnitInfo *uis,
+                        int *results,
+                        int count)
+{
+    struct chmBatchPath *paths;
+    int i, resolved;
+
+    for (i=0; i<count; i++)
+        results[i] = CHM_RESOLVE_FAILURE;
+    if (h == NULL  ||  count <= 0)
+        return 0;
+
+    paths = (struct chmBatchPath *)malloc(count * sizeof(struct chmBatchPath));
+    if (paths == NULL)
+        return 0;
+    for (i=0; i<count; i++)
+    {
+        paths[i].path = objPaths[i];
+        paths[i].index = i;
     }
+    qsort(paths, count, sizeof(struct chmBatchPath), _chm_compare_batch_paths);
 
-    /* didn't find anything.  fail. */
-    free(page_buf);
-    return CHM_RESOLVE_FAILURE;
+    resolved = _chm_resolve_batch(h, h->index_root, paths, count,
+                                  uis, results, 0);
+
+    free(paths);
+    return resolved;
 }
 
 /*
@@ -1325,8 +3621,17 @@ static int _chm_get_cmpblock_bounds(struct chmFile *h,
     UChar buffer[8], *dummy;
     unsigned int remain;
 
+    /* use the in-memory copy of the reset table, if we have one */
+    if (h->rt_offsets != NULL)
+    {
+        if (block >= h->reset_table.block_count)
+            return 0;
+        *start = h->rt_offsets[block];
+        *len = (Int64)h->rt_offsets[block + 1];
+    }
+
     /* for all but the last block, use the reset table */
-    if (block < h->reset_table.block_count-1)
+    else if (block < h->reset_table.block_count-1)
     {
         /* unpack the start address */
         dummy = buffer;
@@ -1378,124 +3683,228 @@ static int _chm_get_cmpblock_bounds(struct chmFile *h,
     return 1;
 }
 
-/* decompress the block.  must have lzx_mutex. */
-static Int64 _chm_decompress_block(struct chmFile *h,
-                                   UInt64 block,
-                                   UChar **ubuffer)
+/* read the compressed bytes of blocks first to last in one go, or of as
+ * many of them as fit in CHM_MAX_SPAN_BYTES.  Needs the reset table in
+ * memory; return 0 on failure.
+ */
+static int _chm_read_cmpspan(struct chmFile *h,
+                             struct chmCmpSpan *span,
+                             UInt64 first,
+                             UInt64 last)
 {
-    UChar *cbuffer = malloc(((unsigned int)h->reset_table.block_len + 6144));
-    UInt64 cmpStart;                                    /* compressed start  */
-    Int64 cmpLen;                                       /* compressed len    */
-    int indexSlot;                                      /* cache index slot  */
-    UChar *lbuffer;                                     /* local buffer ptr  */
-    UInt32 blockAlign = (UInt32)(block % h->reset_blkcount); /* reset intvl. aln. */
-    UInt32 i;                                           /* local loop index  */
+    UInt64 len;
 
-    if (cbuffer == NULL)
-        return -1;
+    span->len = 0;
+    if (h->rt_offsets == NULL  ||  first > last  ||
+        last >= h->reset_table.block_count)
+        return 0;
 
-    /* let the caching system pull its weight! */
-    if (block - blockAlign <= h->lzx_last_block  &&
-        block              >= h->lzx_last_block)
-        blockAlign = (block - h->lzx_last_block);
+    while (last > first  &&
+           h->rt_offsets[last + 1] - h->rt_offsets[first] > CHM_MAX_SPAN_BYTES)
+        --last;
+    if (h->rt_offsets[last + 1] < h->rt_offsets[first])
+        return 0;
+    len = h->rt_offsets[last + 1] - h->rt_offsets[first];
 
-    /* check if we need previous blocks */
-    if (blockAlign != 0)
+    if (span->size < len)
     {
-        /* fetch all required previous blocks since last reset */
-        for (i = blockAlign; i > 0; i--)
-        {
-            UInt32 curBlockIdx = block - i;
+        UChar *data = (UChar *)realloc(span->data, (size_t)len);
+        if (data == NULL)
+            return 0;
+        span->data = data;
+        span->size = len;
+    }
 
-            /* check if we most recently decompressed the previous block */
-            if (h->lzx_last_block != curBlockIdx)
-            {
-                if ((curBlockIdx % h->reset_blkcount) == 0)
-                {
-#ifdef CHM_DEBUG
-                    fprintf(stderr, "***RESET (1)***\n");
-#endif
-                    LZXreset(h->lzx_state);
-                }
+    span->start = (UInt64)h->data_offset + (UInt64)h->cn_unit.start
+                  + h->rt_offsets[first];
+    if (_chm_fetch_bytes(h, span->data, span->start, len) != (Int64)len)
+        return 0;
+    span->len = len;
+    return 1;
+}
 
-                indexSlot = (int)((curBlockIdx) % h->cache_num_blocks);
-                if (! h->cache_blocks[indexSlot])
-                    h->cache_blocks[indexSlot] = (UChar *)malloc((unsigned int)(h->reset_table.block_len));
-                if (! h->cache_blocks[indexSlot])
-                {
-                    free(cbuffer);
-                    return -1;
-                }
-                h->cache_block_indices[indexSlot] = curBlockIdx;
-                lbuffer = h->cache_blocks[indexSlot];
+/* whether a span holds the compressed bytes of a block */
+static int _chm_span_holds(struct chmFile *h,
+                           struct chmCmpSpan *span,
+                           UInt64 block)
+{
+    UInt64 start;
+
+    if (span->len == 0  ||  h->rt_offsets == NULL  ||
+        block >= h->reset_table.block_count)
+        return 0;
+    start = (UInt64)h->data_offset + (UInt64)h->cn_unit.start;
+    return start + h->rt_offsets[block] >= span->start  &&
+           start + h->rt_offsets[block + 1] <= span->start + span->len;
+}
+
+/* get the compressed bytes of a block, read into cbuffer unless they can
+ * be decoded straight out of the file mapping or a span already read.
+ * The decoder never reads past the end of its input, so a block which
+ * ends the file can be decoded in place.
+ */
+static UChar *_chm_get_cmpblock(struct chmFile *h,
+                                UChar *cbuffer,
+                                struct chmCmpSpan *span,
+                                UInt64 cmpStart,
+                                Int64 cmpLen)
+{
+    UChar *mapped = _chm_map_bytes(h, cmpStart, cmpLen);
+    if (mapped != NULL)
+        return mapped;
+    if (span != NULL  &&  span->len != 0  &&
+        cmpStart >= span->start  &&
+        cmpStart + cmpLen <= span->start + span->len)
+        return span->data + (cmpStart - span->start);
+    if (_chm_fetch_bytes(h, cbuffer, cmpStart, cmpLen) != cmpLen)
+        return NULL;
+    return cbuffer;
+}
+
+/* decode the next block of a stream.  Its bytes are left in the decoder's
+ * window, unless they had to be translated into buffer; either way, they
+ * last until the next block is decoded.  return NULL on failure
+ */
+static UChar *_chm_decode_block(struct chmFile *h,
+                                struct LZXstate *state,
+                                UChar *buffer,
+                                UInt64 block,
+                                UChar *cbuffer,
+                                struct chmCmpSpan *span)
+{
+    UInt64 cmpStart;                                    /* compressed start  */
+    Int64 cmpLen;                                       /* compressed len    */
+    UChar *cdata;                                       /* compressed data   */
+    UChar *data;                                        /* decompressed data */
 
-                /* decompress the previous block */
+    if (! _chm_get_cmpblock_bounds(h, block, &cmpStart, &cmpLen)          ||
+        cmpLen < 0                                                        ||
+        cmpLen > h->reset_table.block_len + 6144                          ||
+        (cdata = _chm_get_cmpblock(h, cbuffer, span,
+                                   cmpStart, cmpLen)) == NULL             ||
+        LZXdecompressview(state, cdata, buffer, (int)cmpLen,
+                          (int)h->reset_table.block_len, &data) != DECR_OK)
+    {
 #ifdef CHM_DEBUG
-                fprintf(stderr, "Decompressing block #%4d (EXTRA)\n", curBlockIdx);
-#endif
-                if (!_chm_get_cmpblock_bounds(h, curBlockIdx, &cmpStart, &cmpLen) ||
-                    cmpLen < 0                                                    ||
-                    cmpLen > h->reset_table.block_len + 6144                      ||
-                    _chm_fetch_bytes(h, cbuffer, cmpStart, cmpLen) != cmpLen      ||
-                    LZXdecompress(h->lzx_state, cbuffer, lbuffer, (int)cmpLen,
-                                  (int)h->reset_table.block_len) != DECR_OK)
-                {
+        fprintf(stderr, "   (DECOMPRESS FAILED!)\n");
+#endif
+        return NULL;
+    }
+    return data;
+}
+
+/* decompress one block into a decoder, and publish it to the
+ * caches.  must have the decoder's mutex.
+ */
+static int _chm_decompress_one(struct chmFile *h,
+                               struct chmDecoder *d,
+                               UInt64 block,
+                               UChar *cbuffer,
+                               int referenced)
+{
 #ifdef CHM_DEBUG
-                    fprintf(stderr, "   (DECOMPRESS FAILED!)\n");
+    fprintf(stderr, "Decompressing block #%4d (%s)\n", (int)block,
+            referenced ? "REAL " : "EXTRA");
 #endif
-                    free(cbuffer);
-                    return (Int64)0;
-                }
+    d->data = _chm_decode_block(h, d->state, d->buffer, block, cbuffer,
+                                &d->span);
+    if (d->data == NULL)
+    {
+        d->last_block = -1;
+        return 0;
+    }
+    d->last_block = (int)block;
+    _chm_save_checkpoint(h, d, block);
 
-                h->lzx_last_block = (int)curBlockIdx;
-            }
-        }
+    /* blocks decompressed only to replay the stream go into the cache
+     * unreferenced, so that replays do not flush hot blocks
+     */
+    CHM_ACQUIRE_LOCK(h->cache_mutex);
+    _chm_cache_insert(h, block, d->data, referenced);
+    CHM_RELEASE_LOCK(h->cache_mutex);
+    if (h->shared_cache)
+        _chm_shared_insert(&h->file_id, block, d->data,
+                           (UInt32)h->reset_table.block_len, referenced);
+    return 1;
+}
+
+/* decompress the block into the decoder, leaving its bytes at d->data.
+ * must have the decoder's mutex.
+ */
+static Int64 _chm_decompress_block(struct chmFile *h,
+                                   struct chmDecoder *d,
+                                   UInt64 block)
+{
+    UInt64 first = block - block % h->reset_blkcount;   /* reset point      */
+    UInt64 cur;                                         /* next to decode   */
+    struct chmCheckpoint *c;
+
+    /* start up the decompressor machine, if this one is new */
+    if (! d->state)
+    {
+        int window_size = ffs(h->window_size) - 1;
+        d->last_block = -1;
+        if (! d->buffer)
+            d->buffer = (UChar *)malloc((size_t)h->reset_table.block_len);
+        if (! d->cbuffer)
+            d->cbuffer = (UChar *)malloc(
+                    (size_t)h->reset_table.block_len + 6144);
+        if (! d->buffer  ||  ! d->cbuffer  ||
+            ! (d->state = _chm_get_state(window_size)))
+            return (Int64)0;
     }
+
+    /* it may have been left holding this very block */
+    if (d->last_block != -1  &&  (UInt64)d->last_block == block)
+        return h->reset_table.block_len;
+
+    /* let the caching system pull its weight! */
+    if (d->last_block != -1            &&
+        (UInt64)d->last_block >= first  &&
+        (UInt64)d->last_block < block)
+        cur = d->last_block + 1;
     else
+        cur = first;
+
+    /* ...or a checkpoint nearer the block, if there is one */
+    c = _chm_get_checkpoint(h, cur, block);
+    if (c != NULL)
     {
-        if ((block % h->reset_blkcount) == 0)
+        if (LZXrestore(d->state, c->state) == DECR_OK)
         {
+            d->last_block = (int)c->block;
+            cur = c->block + 1;
+        }
+        _chm_put_checkpoint(h, c);
+    }
+
+    if (cur == first)
+    {
 #ifdef CHM_DEBUG
-            fprintf(stderr, "***RESET (2)***\n");
+        fprintf(stderr, "***RESET***\n");
 #endif
-            LZXreset(h->lzx_state);
-        }
+        LZXreset(d->state);
     }
 
-    /* allocate slot in cache */
-    indexSlot = (int)(block % h->cache_num_blocks);
-    if (! h->cache_blocks[indexSlot])
-        h->cache_blocks[indexSlot] = (UChar *)malloc(((unsigned int)h->reset_table.block_len));
-    if (! h->cache_blocks[indexSlot])
+    /* fetch all required previous blocks since last reset.  Unless the
+     * file is mapped, their compressed bytes are read together, along
+     * with those of the block we actually want.
+     */
+    for (; cur < block; cur++)
     {
-        free(cbuffer);
-        return -1;
+        if (h->map == NULL  &&  ! _chm_span_holds(h, &d->span, cur))
+            _chm_read_cmpspan(h, &d->span, cur, block);
+        if (! _chm_decompress_one(h, d, cur, d->cbuffer, 0))
+            return (Int64)0;
     }
-    h->cache_block_indices[indexSlot] = block;
-    lbuffer = h->cache_blocks[indexSlot];
-    *ubuffer = lbuffer;
 
     /* decompress the block we actually want */
-#ifdef CHM_DEBUG
-    fprintf(stderr, "Decompressing block #%4d (REAL )\n", block);
-#endif
-    if (! _chm_get_cmpblock_bounds(h, block, &cmpStart, &cmpLen)          ||
-        _chm_fetch_bytes(h, cbuffer, cmpStart, cmpLen) != cmpLen          ||
-        LZXdecompress(h->lzx_state, cbuffer, lbuffer, (int)cmpLen,
-                      (int)h->reset_table.block_len) != DECR_OK)
-    {
-#ifdef CHM_DEBUG
-        fprintf(stderr, "   (DECOMPRESS FAILED!)\n");
-#endif
-        free(cbuffer);
+    if (! _chm_decompress_one(h, d, block, d->cbuffer, 1))
         return (Int64)0;
-    }
-    h->lzx_last_block = (int)block;
 
     /* XXX: modify LZX routines to return the length of the data they
      * decompressed and return that instead, for an extra sanity check.
      */
-    free(cbuffer);
     return h->reset_table.block_len;
 }
 
@@ -1507,8 +3916,8 @@ static Int64 _chm_decompress_region(struct chmFile *h,
 {
     UInt64 nBlock, nOffset;
     UInt64 nLen;
-    UInt64 gotLen;
-    UChar *ubuffer;
+    Int64 gotLen;
+    struct chmDecoder *d;
 
     if (len <= 0)
         return (Int64)0;
@@ -1521,35 +3930,297 @@ static Int64 _chm_decompress_region(struct chmFile *h,
         nLen = h->reset_table.block_len - nOffset;
 
     /* if block is cached, return data from it. */
-    CHM_ACQUIRE_LOCK(h->lzx_mutex);
-    CHM_ACQUIRE_LOCK(h->cache_mutex);
-    if (h->cache_block_indices[nBlock % h->cache_num_blocks] == nBlock    &&
-        h->cache_blocks[nBlock % h->cache_num_blocks] != NULL)
-    {
-        memcpy(buf,
-               h->cache_blocks[nBlock % h->cache_num_blocks] + nOffset,
-               (unsigned int)nLen);
-        CHM_RELEASE_LOCK(h->cache_mutex);
-        CHM_RELEASE_LOCK(h->lzx_mutex);
+    if (_chm_cache_read(h, nBlock, buf, nOffset, nLen))
+        return nLen;
+
+    /* another handle on the same file may have decompressed it already */
+    if (h->shared_cache  &&
+        _chm_shared_lookup(&h->file_id, nBlock, buf, nOffset, nLen))
         return nLen;
-    }
-    CHM_RELEASE_LOCK(h->cache_mutex);
 
     /* data request not satisfied, so... start up the decompressor machine */
-    if (! h->lzx_state)
-    {
-        int window_size = ffs(h->window_size) - 1;
-        h->lzx_last_block = -1;
-        h->lzx_state = LZXinit(window_size);
-    }
+    d = _chm_acquire_decoder(h, nBlock);
+    if (d == NULL)
+        return (Int64)0;
 
     /* decompress some data */
-    gotLen = _chm_decompress_block(h, nBlock, &ubuffer);
-    if (gotLen < nLen)
+    gotLen = _chm_decompress_block(h, d, nBlock);
+    if (gotLen <= 0)
+    {
+        _chm_release_decoder(h, d);
+        return (Int64)0;
+    }
+    if ((UInt64)gotLen < nLen)
         nLen = gotLen;
-    memcpy(buf, ubuffer+nOffset, (unsigned int)nLen);
+    memcpy(buf, d->data+nOffset, (unsigned int)nLen);
+    _chm_release_decoder(h, d);
+    return nLen;
+}
+
+#ifdef CHM_MT
+#ifdef WIN32
+#define CHM_WAIT(c, m)      SleepConditionVariableCS(&(c), &(m), INFINITE)
+#define CHM_BROADCAST(c)    WakeAllConditionVariable(&(c))
+#else
+#define CHM_WAIT(c, m)      pthread_cond_wait(&(c), &(m))
+#define CHM_BROADCAST(c)    pthread_cond_broadcast(&(c))
+#endif
+
+/* a worker: run queued tasks, forever */
+#ifdef WIN32
+static DWORD WINAPI _chm_worker_main(LPVOID arg)
+#else
+static void *_chm_worker_main(void *arg)
+#endif
+{
+    struct chmWorkerPool *p = &_chm_workers;
+    struct chmTask *t;
+
+    (void)arg;
+    CHM_ACQUIRE_LOCK(p->mutex);
+    for (;;)
+    {
+        while (p->head == NULL)
+        {
+            ++p->idle;
+            CHM_WAIT(p->queued, p->mutex);
+            --p->idle;
+        }
+        t = p->head;
+        p->head = t->next;
+        if (p->head == NULL)
+            p->tail = NULL;
+        t->running = 1;
+        CHM_RELEASE_LOCK(p->mutex);
+
+        t->fn(t->arg);
+
+        CHM_ACQUIRE_LOCK(p->mutex);
+        t->running = 0;
+        CHM_BROADCAST(p->finished);
+    }
+    return 0;
+}
+#endif
+
+/* run fn on up to count threads, the calling thread being the first, and
+ * the rest taken from the worker pool; thread i is passed args + i*stride.
+ * Shares which no worker has taken by the time the calling thread is done
+ * are dropped, as are those of threads which fail to start, so fn must
+ * take its work from a shared pool.
+ */
+static void _chm_run_threads(void (*fn)(void *),
+                             void *args,
+                             size_t stride,
+                             int count)
+{
+#ifdef CHM_MT
+    struct chmWorkerPool *p = &_chm_workers;
+    struct chmTask *tasks = NULL, **link;
+    int i, busy;
+
+    if (count > 1)
+        tasks = (struct chmTask *)calloc(count - 1, sizeof(struct chmTask));
+    if (tasks != NULL)
+    {
+        CHM_ACQUIRE_LOCK(p->mutex);
+        for (i=0; i<count-1; i++)
+        {
+            tasks[i].fn = fn;
+            tasks[i].arg = (UChar *)args + (i + 1)*stride;
+            if (p->tail != NULL)
+                p->tail->next = &tasks[i];
+            else
+                p->head = &tasks[i];
+            p->tail = &tasks[i];
+        }
+
+        /* start more workers if there are not enough waiting */
+        for (i=p->idle; i<count-1  &&  p->threads<CHM_MAX_WORKERS; i++)
+        {
+#ifdef WIN32
+            HANDLE thread = CreateThread(NULL, 0, _chm_worker_main,
+                                         NULL, 0, NULL);
+            if (thread == NULL)
+                break;
+            CloseHandle(thread);
+#else
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, _chm_worker_main, NULL) != 0)
+                break;
+            pthread_detach(thread);
+#endif
+            ++p->threads;
+        }
+        CHM_BROADCAST(p->queued);
+        CHM_RELEASE_LOCK(p->mutex);
+    }
+#else
+    (void)stride;
+    (void)count;
+#endif
+
+    fn(args);
+
+#ifdef CHM_MT
+    if (tasks == NULL)
+        return;
+
+    /* drop the shares not yet taken, and wait for the rest */
+    CHM_ACQUIRE_LOCK(p->mutex);
+    p->tail = NULL;
+    for (link = &p->head; *link != NULL; )
+    {
+        if (*link >= tasks  &&  *link < tasks + count - 1)
+            *link = (*link)->next;
+        else
+        {
+            p->tail = *link;
+            link = &(*link)->next;
+        }
+    }
+    do {
+        busy = 0;
+        for (i=0; i<count-1; i++)
+            busy |= tasks[i].running;
+        if (busy)
+            CHM_WAIT(p->finished, p->mutex);
+    } while (busy);
+    CHM_RELEASE_LOCK(p->mutex);
+    free(tasks);
+#endif
+}
+
+/* a read spanning several reset intervals, which are decoded in parallel */
+struct chmParallelRead
+{
+    struct chmFile         *h;
+    UChar                  *buf;
+    UInt64                  start;
+    UInt64                  len;
+    UInt64                  interval_len;
+
+    /* guarded by mutex */
+    UInt64                  next;       /* next interval to decode        */
+    UInt64                  end;        /* ...and one past the last       */
+    UInt64                  got;        /* bytes up to the first failure  */
+#ifdef CHM_MT
+#ifdef WIN32
+    CRITICAL_SECTION        mutex;
+#else
+    pthread_mutex_t         mutex;
+#endif
+#endif
+};
+
+static void _chm_parallel_read_work(void *arg)
+{
+    struct chmParallelRead *r = (struct chmParallelRead *)arg;
+    UInt64 interval, from, to;
+    Int64 swath;
+
+    for (;;)
+    {
+        /* take the next interval, unless the read has already failed
+         * before it
+         */
+        CHM_ACQUIRE_LOCK(r->mutex);
+        interval = r->next;
+        if (interval < r->end  &&
+            interval*r->interval_len < r->start + r->got)
+            ++r->next;
+        else
+            interval = r->end;
+        CHM_RELEASE_LOCK(r->mutex);
+        if (interval == r->end)
+            break;
+
+        from = interval*r->interval_len;
+        if (from < r->start)
+            from = r->start;
+        to = (interval + 1)*r->interval_len;
+        if (to > r->start + r->len)
+            to = r->start + r->len;
+
+        while (from < to)
+        {
+            swath = _chm_decompress_region(r->h, r->buf + (from - r->start),
+                                           from, to - from);
+            if (swath <= 0)
+                break;
+            from += swath;
+        }
+
+        if (from < to)
+        {
+            CHM_ACQUIRE_LOCK(r->mutex);
+            if (from - r->start < r->got)
+                r->got = from - r->start;
+            CHM_RELEASE_LOCK(r->mutex);
+        }
+    }
+}
+
+/* decompress a region spanning several reset intervals on as many threads
+ * as CHM_PARAM_PARALLEL_DECODE allows and there are decoders for.  Returns
+ * -1 if it is not worth the threads.
+ */
+static Int64 _chm_decompress_parallel(struct chmFile *h,
+                                      UChar *buf,
+                                      UInt64 start,
+                                      Int64 len)
+{
+    struct chmParallelRead r;
+    UInt64 interval_len, intervals;
+    int threads;
+
+    if (len <= 0  ||  h->reset_table.block_len == 0  ||
+        h->reset_blkcount == 0)
+        return -1;
+
+    /* most reads, cache hits among them, stop here without taking a lock */
+    interval_len = h->reset_blkcount * h->reset_table.block_len;
+    intervals = (start + len - 1) / interval_len + 1 - start / interval_len;
+    if (intervals < CHM_PARALLEL_MIN_INTERVALS)
+        return -1;
+    threads = CHM_LOAD_RELAXED(h->parallel_decode);
+    if (threads < 2)
+        return -1;
+    CHM_ACQUIRE_LOCK(h->lzx_mutex);
+    if (threads > h->num_decoders)
+        threads = h->num_decoders;
     CHM_RELEASE_LOCK(h->lzx_mutex);
-    return nLen;
+    if (threads < 2)
+        return -1;
+    if ((UInt64)threads > intervals)
+        threads = (int)intervals;
+
+    memset(&r, 0, sizeof(r));
+    r.h = h;
+    r.buf = buf;
+    r.start = start;
+    r.len = (UInt64)len;
+    r.interval_len = interval_len;
+    r.next = start / interval_len;
+    r.end = r.next + intervals;
+    r.got = r.len;
+
+#ifdef CHM_MT
+#ifdef WIN32
+    InitializeCriticalSection(&r.mutex);
+#else
+    pthread_mutex_init(&r.mutex, NULL);
+#endif
+#endif
+    _chm_run_threads(_chm_parallel_read_work, &r, 0, threads);
+#ifdef CHM_MT
+#ifdef WIN32
+    DeleteCriticalSection(&r.mutex);
+#else
+    pthread_mutex_destroy(&r.mutex);
+#endif
+#endif
+    return (Int64)r.got;
 }
 
 /* retrieve (part of) an object */
@@ -1590,6 +4261,12 @@ LONGINT64 chm_retrieve_object(struct chmFile *h,
         if (! h->compression_enabled)
             return total;
 
+        /* spread big reads over several threads, if allowed to */
+        total = _chm_decompress_parallel(h, buf, ui->start + addr, len);
+        if (total >= 0)
+            return total;
+        total = 0;
+
         do {
 
             /* swill another mouthful */
@@ -1611,6 +4288,302 @@ LONGINT64 chm_retrieve_object(struct chmFile *h,
     }
 }
 
+/* one block's worth of a request to chm_retrieve_objects */
+struct chmBatchPiece
+{
+    UInt64              block;
+    UInt64              offset;         /* within the block               */
+    UInt64              len;
+    UChar              *dest;
+    Int32               req;
+    UInt64              reqOffset;      /* within the request             */
+};
+
+static int _chm_compare_pieces(const void *a, const void *b)
+{
+    const struct chmBatchPiece *pa = (const struct chmBatchPiece *)a;
+    const struct chmBatchPiece *pb = (const struct chmBatchPiece *)b;
+    if (pa->block != pb->block)
+        return (pa->block < pb->block) ? -1 : 1;
+    return (pa->offset < pb->offset) ? -1 : (pa->offset > pb->offset);
+}
+
+/* how much of a request chm_retrieve_object would try to retrieve */
+static Int64 _chm_clip_request(struct chmRetrieval *r)
+{
+    if (r->addr >= r->ui->length  ||  r->len <= 0)
+        return 0;
+    if (r->addr + r->len > r->ui->length)
+        return r->ui->length - r->addr;
+    return r->len;
+}
+
+/* retrieve (parts of) several objects at once.  Compressed data is
+ * gathered block by block, in stream order, so that each block is
+ * decompressed at most once however many objects share it.
+ */
+int chm_retrieve_objects(struct chmFile *h,
+                         struct chmRetrieval *reqs,
+                         int count)
+{
+    struct chmBatchPiece *pieces;
+    UChar *ubuffer;
+    UInt64 blockLen, start, end, block;
+    Int64 len, gotLen;
+    Int32 numPieces = 0, i, j;
+    int done = 0;
+
+    if (h == NULL  ||  count <= 0)
+        return 0;
+
+    /* read the uncompressed requests right away, and count the blocks the
+     * rest will need
+     */
+    blockLen = h->reset_table.block_len;
+    for (i=0; i<count; i++)
+    {
+        struct chmRetrieval *r = &reqs[i];
+
+        r->result = 0;
+        len = _chm_clip_request(r);
+        if (len == 0)
+            continue;
+        if (r->ui->space == CHM_UNCOMPRESSED)
+            r->result = chm_retrieve_object(h, r->ui, r->buf, r->addr, len);
+        else if (h->compression_enabled)
+        {
+            start = r->ui->start + r->addr;
+            end = start + len - 1;
+            numPieces += (Int32)(end / blockLen - start / blockLen + 1);
+        }
+    }
+
+    if (numPieces == 0)
+        goto finish;
+
+    /* split the compressed requests at block boundaries, and sort the
+     * pieces into stream order
+     */
+    pieces = (struct chmBatchPiece *)malloc(numPieces * sizeof(struct chmBatchPiece));
+    ubuffer = _chm_get_scratch(h);
+    if (pieces == NULL  ||  ubuffer == NULL)
+    {
+        free(pieces);
+        _chm_put_scratch(h, ubuffer);
+        goto finish;
+    }
+    numPieces = 0;
+    for (i=0; i<count; i++)
+    {
+        struct chmRetrieval *r = &reqs[i];
+        UInt64 reqOffset = 0;
+
+        len = _chm_clip_request(r);
+        if (len == 0  ||  r->ui->space == CHM_UNCOMPRESSED  ||
+            ! h->compression_enabled)
+            continue;
+
+        /* until proven otherwise, the whole request is retrieved */
+        r->result = len;
+        start = r->ui->start + r->addr;
+        while (reqOffset < (UInt64)len)
+        {
+            struct chmBatchPiece *p = &pieces[numPieces++];
+            p->block = (start + reqOffset) / blockLen;
+            p->offset = (start + reqOffset) % blockLen;
+            p->len = blockLen - p->offset;
+            if (p->len > (UInt64)len - reqOffset)
+                p->len = (UInt64)len - reqOffset;
+            p->dest = r->buf + reqOffset;
+            p->req = i;
+            p->reqOffset = reqOffset;
+            reqOffset += p->len;
+        }
+    }
+    qsort(pieces, numPieces, sizeof(struct chmBatchPiece), _chm_compare_pieces);
+
+    /* fetch each block once, and scatter it */
+    for (i=0; i<numPieces; i=j)
+    {
+        int lone;
+
+        block = pieces[i].block;
+        for (j=i; j<numPieces  &&  pieces[j].block == block; j++)
+            ;
+
+        /* a lone piece goes straight to its destination */
+        lone = (j == i + 1);
+        if (lone)
+        {
+            gotLen = _chm_decompress_region(h,
+                                            pieces[i].dest,
+                                            block * blockLen + pieces[i].offset,
+                                            pieces[i].len);
+            gotLen += pieces[i].offset;
+        }
+        else
+            gotLen = _chm_decompress_region(h,
+                                            ubuffer,
+                                            block * blockLen,
+                                            blockLen);
+
+        for (; i<j; i++)
+        {
+            struct chmRetrieval *r = &reqs[pieces[i].req];
+
+            /* a request gets no further than its first missing piece */
+            if ((UInt64)gotLen < pieces[i].offset + pieces[i].len)
+            {
+                if ((UInt64)r->result > pieces[i].reqOffset)
+                    r->result = pieces[i].reqOffset;
+            }
+            else if (! lone)
+                memcpy(pieces[i].dest, ubuffer + pieces[i].offset,
+                       (size_t)pieces[i].len);
+        }
+    }
+    free(pieces);
+    _chm_put_scratch(h, ubuffer);
+
+finish:
+    for (i=0; i<count; i++)
+        if (reqs[i].result == _chm_clip_request(&reqs[i]))
+            ++done;
+    return done;
+}
+
+/* stream (part of) an object to a sink, a block at a time */
+LONGINT64 chm_stream_object(struct chmFile *h,
+                            struct chmUnitInfo *ui,
+                            LONGUINT64 addr,
+                            LONGINT64 len,
+                            CHM_SINK sink,
+                            void *context)
+{
+    UChar *buf;
+    UInt64 bufLen, os;
+    Int64 swath, total=0;
+    int result = CHM_SINK_CONTINUE;
+
+    /* must be valid file handle */
+    if (h == NULL  ||  sink == NULL)
+        return (Int64)0;
+
+    /* starting address must be in correct range */
+    if (addr >= ui->length  ||  len <= 0)
+        return (Int64)0;
+
+    /* clip length */
+    if (addr + len > ui->length)
+        len = ui->length - addr;
+
+    /* if compression is not enabled for this file... */
+    if (ui->space == CHM_COMPRESSED  &&  ! h->compression_enabled)
+        return (Int64)0;
+
+    /* mapped files can hand out uncompressed objects in place */
+    os = (UInt64)h->data_offset + (UInt64)ui->start + (UInt64)addr;
+    if (ui->space == CHM_UNCOMPRESSED  &&
+        (buf = _chm_map_bytes(h, os, len)) != NULL)
+    {
+        if (sink(h, buf, len, context) == CHM_SINK_FAILURE)
+            return (Int64)-1;
+        return len;
+    }
+
+    /* everything else goes through one block-sized buffer */
+    bufLen = _chm_block_len(h);
+    buf = _chm_get_scratch(h);
+    if (buf == NULL)
+        return (Int64)0;
+
+    while (len != 0)
+    {
+        if (ui->space == CHM_UNCOMPRESSED)
+        {
+            swath = (len < (Int64)bufLen) ? len : (Int64)bufLen;
+            if (_chm_fetch_bytes(h, buf, os + total, swath) != swath)
+                break;
+        }
+        else
+        {
+            swath = _chm_decompress_region(h, buf, ui->start + addr + total,
+                                           len);
+            if (swath == 0)
+                break;
+        }
+
+        total += swath;
+        len -= swath;
+        result = sink(h, buf, swath, context);
+        if (result != CHM_SINK_CONTINUE)
+            break;
+    }
+
+    _chm_put_scratch(h, buf);
+    return (result == CHM_SINK_FAILURE) ? (Int64)-1 : total;
+}
+
+/* get a read-only view of (part of) an uncompressed object */
+LONGINT64 chm_view_object(struct chmFile *h,
+                          struct chmUnitInfo *ui,
+                          const unsigned char **view,
+                          LONGUINT64 addr,
+                          LONGINT64 len)
+{
+    UInt64 os;
+    UChar *data;
+
+    *view = NULL;
+
+    /* must be valid file handle, and an object we need not decompress */
+    if (h == NULL  ||  ui->space != CHM_UNCOMPRESSED)
+        return (Int64)0;
+
+    /* starting address must be in correct range */
+    if (addr >= ui->length  ||  len <= 0)
+        return (Int64)0;
+
+    /* clip length */
+    if (addr + len > ui->length)
+        len = ui->length - addr;
+
+    /* mapped files can hand out the bytes in place */
+    os = (UInt64)h->data_offset + (UInt64)ui->start + (UInt64)addr;
+    data = _chm_map_bytes(h, os, len);
+    if (data == NULL)
+    {
+        if (h->map != NULL)
+            return (Int64)0;
+
+        /* otherwise, read them into a buffer of their own */
+        if ((UInt64)len != (UInt64)(size_t)len  ||
+            (data = (UChar *)malloc((size_t)len)) == NULL)
+            return (Int64)0;
+        if (_chm_fetch_bytes(h, data, os, len) != len)
+        {
+            free(data);
+            return (Int64)0;
+        }
+    }
+
+    *view = data;
+    return len;
+}
+
+/* release a view returned by chm_view_object */
+void chm_release_view(struct chmFile *h,
+                      const unsigned char *view)
+{
+    if (h == NULL  ||  view == NULL)
+        return;
+
+    /* only views which do not point into the mapping own their bytes */
+    if (h->map == NULL  ||
+        view < h->map   ||  view >= h->map + h->map_len)
+        free((void *)view);
+}
+
 /* enumerate the objects in the .chm archive */
 int chm_enumerate(struct chmFile *h,
                   int what,
@@ -1621,7 +4594,9 @@ int chm_enumerate(struct chmFile *h,
 
     /* buffer to hold whatever page we're looking at */
     /* RWE 6/12/2003 */
-    UChar *page_buf = malloc((unsigned int)h->block_len);
+    UChar *page_buf = _chm_get_scratch(h);
+    UChar *page;
+    struct chmDirPage *held;
     struct chmPmglHeader header;
     UChar *end;
     UChar *cur;
@@ -1643,13 +4618,17 @@ int chm_enumerate(struct chmFile *h,
     while (curPage != -1)
     {
 
-        /* try to fetch the index page */
-        if (_chm_fetch_bytes(h,
-                             page_buf,
-                             (UInt64)h->dir_offset + (UInt64)curPage*h->block_len,
-                             h->block_len) != h->block_len)
+        /* try to fetch the index page; leaf pages only come from the
+         * cache if they are already there, so that a full walk does not
+         * evict the index pages
+         */
+        page = _chm_fetch_dir_page(h, curPage, &page_buf, 0, &held);
+        if (page != NULL  &&  page != page_buf)
+            memcpy(page_buf, page, h->block_len);
+        _chm_release_dir_page(h, held);
+        if (page == NULL)
         {
-            free(page_buf);
+            _chm_put_scratch(h, page_buf);
             return 0;
         }
 
@@ -1658,7 +4637,7 @@ int chm_enumerate(struct chmFile *h,
         lenRemain = _CHM_PMGL_LEN;
         if (! _unmarshal_pmgl_header(&cur, &lenRemain, &header))
         {
-            free(page_buf);
+            _chm_put_scratch(h, page_buf);
             return 0;
         }
         end = page_buf + h->block_len - (header.free_space);
@@ -1670,7 +4649,7 @@ int chm_enumerate(struct chmFile *h,
 
             if (! _chm_parse_PMGL_entry(&cur, &ui))
             {
-                free(page_buf);
+                _chm_put_scratch(h, page_buf);
                 return 0;
             }
 
@@ -1710,12 +4689,12 @@ int chm_enumerate(struct chmFile *h,
                 switch (status)
                 {
                     case CHM_ENUMERATOR_FAILURE:
-                        free(page_buf);
+                        _chm_put_scratch(h, page_buf);
                         return 0;
                     case CHM_ENUMERATOR_CONTINUE:
                         break;
                     case CHM_ENUMERATOR_SUCCESS:
-                        free(page_buf);
+                        _chm_put_scratch(h, page_buf);
                         return 1;
                     default:
                         break;
@@ -1727,7 +4706,7 @@ int chm_enumerate(struct chmFile *h,
         curPage = header.block_next;
     }
 
-    free(page_buf);
+    _chm_put_scratch(h, page_buf);
     return 1;
 }
 
@@ -1745,7 +4724,9 @@ int chm_enumerate_dir(struct chmFile *h,
 
     /* buffer to hold whatever page we're looking at */
     /* RWE 6/12/2003 */
-    UChar *page_buf = malloc((unsigned int)h->block_len);
+    UChar *page_buf = _chm_get_scratch(h);
+    UChar *page;
+    struct chmDirPage *held;
     struct chmPmglHeader header;
     UChar *end;
     UChar *cur;
@@ -1792,13 +4773,17 @@ int chm_enumerate_dir(struct chmFile *h,
     while (curPage != -1)
     {
 
-        /* try to fetch the index page */
-        if (_chm_fetch_bytes(h,
-                             page_buf,
-                             (UInt64)h->dir_offset + (UInt64)curPage*h->block_len,
-                             h->block_len) != h->block_len)
+        /* try to fetch the index page; leaf pages only come from the
+         * cache if they are already there, so that a full walk does not
+         * evict the index pages
+         */
+        page = _chm_fetch_dir_page(h, curPage, &page_buf, 0, &held);
+        if (page != NULL  &&  page != page_buf)
+            memcpy(page_buf, page, h->block_len);
+        _chm_release_dir_page(h, held);
+        if (page == NULL)
         {
-            free(page_buf);
+            _chm_put_scratch(h, page_buf);
             return 0;
         }
 
@@ -1807,7 +4792,7 @@ int chm_enumerate_dir(struct chmFile *h,
         lenRemain = _CHM_PMGL_LEN;
         if (! _unmarshal_pmgl_header(&cur, &lenRemain, &header))
         {
-            free(page_buf);
+            _chm_put_scratch(h, page_buf);
             return 0;
         }
         end = page_buf + h->block_len - (header.free_space);
@@ -1819,7 +4804,7 @@ int chm_enumerate_dir(struct chmFile *h,
 
             if (! _chm_parse_PMGL_entry(&cur, &ui))
             {
-                free(page_buf);
+                _chm_put_scratch(h, page_buf);
                 return 0;
             }
 
@@ -1840,7 +4825,7 @@ int chm_enumerate_dir(struct chmFile *h,
             {
                 if (strncasecmp(ui.path, prefixRectified, prefixLen) != 0)
                 {
-                    free(page_buf);
+                    _chm_put_scratch(h, page_buf);
                     return 1;
                 }
             }
@@ -1891,12 +4876,12 @@ int chm_enumerate_dir(struct chmFile *h,
                 switch (status)
                 {
                     case CHM_ENUMERATOR_FAILURE:
-                        free(page_buf);
+                        _chm_put_scratch(h, page_buf);
                         return 0;
                     case CHM_ENUMERATOR_CONTINUE:
                         break;
                     case CHM_ENUMERATOR_SUCCESS:
-                        free(page_buf);
+                        _chm_put_scratch(h, page_buf);
                         return 1;
                     default:
                         break;
@@ -1908,6 +4893,474 @@ int chm_enumerate_dir(struct chmFile *h,
         curPage = header.block_next;
     }
 
-    free(page_buf);
+    _chm_put_scratch(h, page_buf);
+    return 1;
+}
+
+/*
+ * whole-archive extraction
+ */
+
+/* an object to be extracted; kept small, as there may be a great many */
+struct chmExtractObject
+{
+    UInt64                  start;
+    UInt64                  length;
+    UInt64                  remaining;  /* not yet handed out; job mutex  */
+    UInt64                  reach;      /* furthest end of it and all     */
+                                        /* the compressed objects before  */
+    size_t                  path;       /* offset into the job's names    */
+    int                     space;
+    int                     flags;
+};
+
+struct chmExtractJob;
+
+/* one extraction thread, and the run of work items it owns.  Items are
+ * reset intervals of the compressed section, then uncompressed objects.
+ */
+struct chmExtractWorker
+{
+    struct chmExtractJob   *job;
+    Int64                   next;       /* next item it owns              */
+    Int64                   end;        /* ...and one past the last       */
+    struct LZXstate        *state;
+    UChar                  *buffer;
+    UChar                  *cbuffer;
+    struct chmCmpSpan       span;
+    struct chmUnitInfo      ui;         /* the object being handed out    */
+};
+
+struct chmExtractJob
+{
+    struct chmFile         *h;
+    CHM_EXTRACTOR           e;
+    void                   *context;
+
+    /* compressed objects by start, then uncompressed ones */
+    struct chmExtractObject *objs;
+    Int32                   num_objs;
+    Int32                   max_objs;
+    Int32                   num_compressed;
+    char                   *names;
+    size_t                  names_len;
+    size_t                  max_names;
+
+    Int64                   num_intervals;
+    Int64                   num_items;
+    struct chmExtractWorker *workers;
+    int                     num_workers;
+
+    /* guarded by mutex */
+    int                     stop;
+    Int32                   done;
+#ifdef CHM_MT
+#ifdef WIN32
+    CRITICAL_SECTION        mutex;
+#else
+    pthread_mutex_t         mutex;
+#endif
+#endif
+};
+
+static int _chm_extract_collect(struct chmFile *h,
+                                struct chmUnitInfo *ui,
+                                void *context)
+{
+    struct chmExtractJob *job = (struct chmExtractJob *)context;
+    struct chmExtractObject *obj;
+    size_t pathLen = strlen(ui->path) + 1;
+
+    if (ui->space == CHM_COMPRESSED  &&  ! h->compression_enabled)
+        return CHM_ENUMERATOR_CONTINUE;
+
+    if (job->num_objs == job->max_objs)
+    {
+        Int32 max = job->max_objs ? job->max_objs * 2 : 256;
+        struct chmExtractObject *objs = (struct chmExtractObject *)
+            realloc(job->objs, max * sizeof(struct chmExtractObject));
+        if (objs == NULL)
+            return CHM_ENUMERATOR_FAILURE;
+        job->objs = objs;
+        job->max_objs = max;
+    }
+    if (job->names_len + pathLen > job->max_names)
+    {
+        size_t max = job->max_names ? job->max_names * 2 : 16384;
+        char *names;
+        while (max < job->names_len + pathLen)
+            max *= 2;
+        names = (char *)realloc(job->names, max);
+        if (names == NULL)
+            return CHM_ENUMERATOR_FAILURE;
+        job->names = names;
+        job->max_names = max;
+    }
+
+    obj = &job->objs[job->num_objs++];
+    obj->start = ui->start;
+    obj->length = ui->length;
+    obj->remaining = ui->length;
+    obj->reach = 0;
+    obj->path = job->names_len;
+    obj->space = ui->space;
+    obj->flags = ui->flags;
+    memcpy(job->names + job->names_len, ui->path, pathLen);
+    job->names_len += pathLen;
+    return CHM_ENUMERATOR_CONTINUE;
+}
+
+static int _chm_extract_compare(const void *a, const void *b)
+{
+    const struct chmExtractObject *oa = (const struct chmExtractObject *)a;
+    const struct chmExtractObject *ob = (const struct chmExtractObject *)b;
+    if (oa->space != ob->space)
+        return (oa->space == CHM_COMPRESSED) ? -1 : 1;
+    if (oa->start != ob->start)
+        return (oa->start < ob->start) ? -1 : 1;
+    return 0;
+}
+
+/* hand a piece of an object to the extractor; a NULL buf says it is
+ * complete
+ */
+static int _chm_extract_call(struct chmExtractJob *job,
+                             struct chmUnitInfo *ui,
+                             Int32 o,
+                             UInt64 addr,
+                             const UChar *buf,
+                             UInt64 len)
+{
+    struct chmExtractObject *obj = &job->objs[o];
+    int status;
+
+    ui->start = obj->start;
+    ui->length = obj->length;
+    ui->space = obj->space;
+    ui->flags = obj->flags;
+    strcpy(ui->path, job->names + obj->path);
+    status = job->e(job->h, ui, addr, buf, len, job->context);
+
+    if (status != CHM_SINK_CONTINUE)
+    {
+        CHM_ACQUIRE_LOCK(job->mutex);
+        job->stop = 1;
+        CHM_RELEASE_LOCK(job->mutex);
+        return 0;
+    }
+    return 1;
+}
+
+static int _chm_extract_piece(struct chmExtractJob *job,
+                              struct chmUnitInfo *ui,
+                              Int32 o,
+                              UInt64 addr,
+                              const UChar *buf,
+                              UInt64 len)
+{
+    int finished;
+
+    if (! _chm_extract_call(job, ui, o, addr, buf, len))
+        return 0;
+
+    CHM_ACQUIRE_LOCK(job->mutex);
+    job->objs[o].remaining -= len;
+    finished = (job->objs[o].remaining == 0);
+    CHM_RELEASE_LOCK(job->mutex);
+    if (! finished)
+        return 1;
+
+    if (! _chm_extract_call(job, ui, o, job->objs[o].length, NULL, 0))
+        return 0;
+    CHM_ACQUIRE_LOCK(job->mutex);
+    ++job->done;
+    CHM_RELEASE_LOCK(job->mutex);
     return 1;
 }
+
+/* take the next work item, stealing from the largest backlog once out of
+ * items of our own; -1 once there is nothing left
+ */
+static Int64 _chm_extract_take(struct chmExtractWorker *w)
+{
+    struct chmExtractJob *job = w->job;
+    struct chmExtractWorker *victim = NULL;
+    Int64 item = -1, half;
+    int i;
+
+    CHM_ACQUIRE_LOCK(job->mutex);
+    if (! job->stop)
+    {
+        if (w->next >= w->end)
+        {
+            for (i=0; i<job->num_workers; i++)
+                if (job->workers[i].end - job->workers[i].next > 0  &&
+                    (victim == NULL  ||
+                     job->workers[i].end - job->workers[i].next >
+                        victim->end - victim->next))
+                    victim = &job->workers[i];
+
+            /* take the back half, leaving it the front */
+            if (victim != NULL)
+            {
+                half = (victim->end - victim->next + 1) / 2;
+                w->end = victim->end;
+                victim->end -= half;
+                w->next = victim->end;
+            }
+        }
+        if (w->next < w->end)
+            item = w->next++;
+    }
+    CHM_RELEASE_LOCK(job->mutex);
+    return item;
+}
+
+/* decode a reset interval, handing out the objects stored in it */
+static void _chm_extract_interval(struct chmExtractWorker *w, UInt64 interval)
+{
+    struct chmExtractJob *job = w->job;
+    struct chmFile *h = job->h;
+    struct chmExtractObject *objs = job->objs;
+    UInt64 blockLen = h->reset_table.block_len;
+    UInt64 block = interval * h->reset_blkcount;
+    UInt64 last = block + h->reset_blkcount;
+    UInt64 limit, bs, be, from, to;
+    Int32 n = job->num_compressed;
+    Int32 k, j, lo, hi;
+    UChar *data;
+
+    if (last > h->reset_table.block_count)
+        last = h->reset_table.block_count;
+    limit = last * blockLen;
+
+    /* first object still open at the start of the interval */
+    lo = 0;
+    hi = n;
+    while (lo < hi)
+    {
+        Int32 mid = lo + (hi - lo) / 2;
+        if (objs[mid].reach > block * blockLen)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    k = lo;
+
+    LZXreset(w->state);
+    for (; block < last; block++)
+    {
+        /* stop once nothing more is stored in this interval */
+        if (k >= n  ||  objs[k].start >= limit)
+            break;
+
+        if (h->map == NULL  &&  ! _chm_span_holds(h, &w->span, block))
+            _chm_read_cmpspan(h, &w->span, block, last - 1);
+        data = _chm_decode_block(h, w->state, w->buffer, block, w->cbuffer,
+                                 &w->span);
+        if (data == NULL)
+            return;
+
+        bs = block * blockLen;
+        be = bs + blockLen;
+        for (j=k; j<n  &&  objs[j].start < be; j++)
+        {
+            from = (objs[j].start > bs) ? objs[j].start : bs;
+            to = objs[j].start + objs[j].length;
+            if (to > be)
+                to = be;
+            if (from < to  &&
+                ! _chm_extract_piece(job, &w->ui, j, from - objs[j].start,
+                                     data + (from - bs), to - from))
+                return;
+        }
+        while (k < n  &&  objs[k].start + objs[k].length <= be)
+            ++k;
+    }
+}
+
+/* hand out an uncompressed object, in place if the archive is mapped */
+static void _chm_extract_uncompressed(struct chmExtractWorker *w, Int32 o)
+{
+    struct chmExtractJob *job = w->job;
+    struct chmFile *h = job->h;
+    struct chmExtractObject *obj = &job->objs[o];
+    UInt64 os = (UInt64)h->data_offset + (UInt64)obj->start;
+    UInt64 bufLen = _chm_block_len(h);
+    UInt64 addr, len;
+    UChar *data;
+
+    /* empty objects were seen to up front */
+    if (obj->length == 0)
+        return;
+
+    data = _chm_map_bytes(h, os, obj->length);
+    if (data != NULL)
+    {
+        _chm_extract_piece(job, &w->ui, o, 0, data, obj->length);
+        return;
+    }
+
+    for (addr=0; addr<obj->length; addr+=len)
+    {
+        len = obj->length - addr;
+        if (len > bufLen)
+            len = bufLen;
+        if (_chm_fetch_bytes(h, w->buffer, os + addr, len) != (Int64)len  ||
+            ! _chm_extract_piece(job, &w->ui, o, addr, w->buffer, len))
+            return;
+    }
+}
+
+static void _chm_extract_work(void *arg)
+{
+    struct chmExtractWorker *w = (struct chmExtractWorker *)arg;
+    struct chmExtractJob *job = w->job;
+    Int64 item;
+
+    while ((item = _chm_extract_take(w)) != -1)
+    {
+        if (item < job->num_intervals)
+            _chm_extract_interval(w, (UInt64)item);
+        else
+            _chm_extract_uncompressed(w, job->num_compressed
+                                         + (Int32)(item - job->num_intervals));
+    }
+}
+
+/* extract every object of the given kinds, decoding reset intervals in
+ * parallel.  Returns the number of objects extracted in full.
+ */
+int chm_extract(struct chmFile *h,
+                int what,
+                int threads,
+                CHM_EXTRACTOR e,
+                void *context)
+{
+    struct chmExtractJob job;
+    struct chmExtractWorker *w;
+    struct chmUnitInfo ui;
+    Int64 share;
+    Int32 o;
+    int i;
+
+    if (h == NULL  ||  e == NULL)
+        return 0;
+
+    memset(&job, 0, sizeof(job));
+    job.h = h;
+    job.e = e;
+    job.context = context;
+
+    /* gather up the objects, and sort them by where they are stored */
+    if (! chm_enumerate(h, what, _chm_extract_collect, &job)  ||
+        job.num_objs == 0)
+        goto finish;
+    qsort(job.objs, job.num_objs, sizeof(struct chmExtractObject),
+          _chm_extract_compare);
+    for (o=0; o<job.num_objs  &&  job.objs[o].space == CHM_COMPRESSED; o++)
+    {
+        job.objs[o].reach = job.objs[o].start + job.objs[o].length;
+        if (o > 0  &&  job.objs[o-1].reach > job.objs[o].reach)
+            job.objs[o].reach = job.objs[o-1].reach;
+    }
+    job.num_compressed = o;
+
+#ifdef CHM_MT
+#ifdef WIN32
+    InitializeCriticalSection(&job.mutex);
+#else
+    pthread_mutex_init(&job.mutex, NULL);
+#endif
+#endif
+
+    /* empty objects are complete already */
+    for (o=0; o<job.num_objs; o++)
+    {
+        if (job.objs[o].length != 0)
+            continue;
+        if (! _chm_extract_call(&job, &ui, o, 0, NULL, 0))
+            goto unlock;
+        ++job.done;
+    }
+
+    if (job.num_compressed > 0)
+    {
+        CHM_ACQUIRE_LOCK(h->lzx_mutex);
+        if (h->rt_state == 0)
+            _chm_load_reset_table(h);
+        CHM_RELEASE_LOCK(h->lzx_mutex);
+        job.num_intervals = (h->reset_table.block_count + h->reset_blkcount - 1)
+                            / h->reset_blkcount;
+    }
+    job.num_items = job.num_intervals + (job.num_objs - job.num_compressed);
+
+    /* one worker per thread, each starting with an even share of items */
+#ifdef CHM_MT
+    if (threads < 1)
+        threads = 1;
+#else
+    threads = 1;
+#endif
+    if (threads > job.num_items)
+        threads = (int)job.num_items;
+    if (threads < 1)
+        goto unlock;
+    job.workers = (struct chmExtractWorker *)
+        calloc(threads, sizeof(struct chmExtractWorker));
+    if (job.workers == NULL)
+        goto unlock;
+    job.num_workers = threads;
+    share = (job.num_items + threads - 1) / threads;
+    for (i=0; i<threads; i++)
+    {
+        w = &job.workers[i];
+        w->job = &job;
+        w->next = i * share;
+        w->end = (i + 1) * share;
+        if (w->end > job.num_items)
+            w->end = job.num_items;
+        if (w->next > w->end)
+            w->next = w->end;
+
+        w->buffer = (UChar *)malloc((size_t)_chm_block_len(h));
+        if (w->buffer == NULL)
+            goto cleanup;
+        if (job.num_compressed > 0)
+        {
+            w->cbuffer = (UChar *)malloc((size_t)h->reset_table.block_len
+                                         + 6144);
+            w->state = _chm_get_state(ffs(h->window_size) - 1);
+            if (w->cbuffer == NULL  ||  w->state == NULL)
+                goto cleanup;
+        }
+    }
+
+    _chm_run_threads(_chm_extract_work, job.workers,
+                     sizeof(struct chmExtractWorker), threads);
+
+cleanup:
+    for (i=0; i<job.num_workers; i++)
+    {
+        if (job.workers[i].state)
+            _chm_put_state(ffs(h->window_size) - 1, job.workers[i].state);
+        free(job.workers[i].buffer);
+        free(job.workers[i].cbuffer);
+        free(job.workers[i].span.data);
+    }
+    free(job.workers);
+
+unlock:
+#ifdef CHM_MT
+#ifdef WIN32
+    DeleteCriticalSection(&job.mutex);
+#else
+    pthread_mutex_destroy(&job.mutex);
+#endif
+#endif
+
+finish:
+    free(job.objs);
+    free(job.names);
+    return job.done;
+}
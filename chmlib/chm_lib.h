@@ -90,15 +90,82 @@ struct chmFile* chm_open(BSTR filename);
 struct chmFile* chm_open(const char *filename);
 #endif
 
+/* open an ITS archive, with flags.  Beware that if a mapped file shrinks or
+ * its volume goes away while open, reading it faults (SIGBUS) rather than
+ * failing.
+ */
+#define CHM_OPEN_MMAP    (1)  /* map the file into memory, if possible */
+#define CHM_OPEN_SHARED_CACHE (2)  /* use the process-wide block cache  */
+#define CHM_OPEN_PRELOAD_RESET_TABLE (4)  /* load it now, not on first use */
+#ifdef PPC_BSTR
+struct chmFile* chm_open_ex(BSTR filename, int flags);
+#else
+struct chmFile* chm_open_ex(const char *filename, int flags);
+#endif
+
 /* close an ITS archive */
 void chm_close(struct chmFile *h);
 
 /* methods for ssetting tuning parameters for particular file */
 #define CHM_PARAM_MAX_BLOCKS_CACHED 0
+#define CHM_PARAM_MAX_DIR_PAGES_CACHED 1
+#define CHM_PARAM_BLOCK_CACHE_BYTES 2
+#define CHM_PARAM_MAX_DECODERS 3
+#define CHM_PARAM_CHECKPOINT_BYTES 4
+#define CHM_PARAM_CHECKPOINT_INTERVAL 5
+#define CHM_PARAM_PARALLEL_DECODE 6
 void chm_set_param(struct chmFile *h,
                    int paramType,
                    int paramVal);
 
+/* statistics about the cache of decompressed blocks */
+struct chmCacheStats
+{
+    LONGUINT64         hits;        /* reads served from the cache        */
+    LONGUINT64         misses;      /* reads which had to decompress      */
+    LONGUINT64         evictions;   /* blocks dropped to make room        */
+    LONGUINT64         blocks;      /* blocks currently cached            */
+    LONGUINT64         max_blocks;  /* size of the cache, in blocks       */
+    LONGUINT64         block_len;   /* size of each block, in bytes       */
+    LONGUINT64         bytes;       /* memory held by cached blocks       */
+    LONGUINT64         max_bytes;   /* size of the cache, in bytes        */
+};
+void chm_get_cache_stats(struct chmFile *h,
+                         struct chmCacheStats *stats);
+
+/* statistics about the LZX decoders of a file */
+struct chmDecoderStats
+{
+    LONGUINT64         decoders;         /* started, each with a window  */
+    LONGUINT64         max_decoders;     /* CHM_PARAM_MAX_DECODERS       */
+    LONGUINT64         checkpoints;      /* decoder checkpoints held     */
+    LONGUINT64         checkpoint_bytes; /* memory held by checkpoints   */
+};
+void chm_get_decoder_stats(struct chmFile *h,
+                           struct chmDecoderStats *stats);
+
+/* the block cache shared by every handle opened with CHM_OPEN_SHARED_CACHE.
+ * Its budget applies to the whole process; setting it empties the cache.
+ * Its statistics report 0 for max_blocks and block_len, as blocks from
+ * different archives may differ in size.
+ */
+void chm_set_shared_cache(LONGUINT64 maxBytes);
+void chm_get_shared_cache_stats(struct chmCacheStats *stats);
+
+/* LZX decoders idle for longer than the timeout give up their windows (of
+ * up to 2 MB each) and decoding tables to a process-wide pool, which any
+ * handle's decoders draw on; the next read that needs one replays from
+ * its reset interval's start, or a checkpoint.  Idle decoders are looked
+ * for when an archive is opened or another decoder finishes a block, so a
+ * process which does neither keeps them; a timeout of 0 keeps them until
+ * chm_close.  The pool holds up to maxBytes of windows; setting it empties
+ * the pool.  Under memory pressure, chm_release_idle_decoders gives up
+ * every idle decoder at once, and empties the pool.
+ */
+void chm_set_decoder_timeout(unsigned int idleMillis);
+void chm_set_window_pool(LONGUINT64 maxBytes);
+void chm_release_idle_decoders(void);
+
 /* resolve a particular object from the archive */
 #define CHM_RESOLVE_SUCCESS (0)
 #define CHM_RESOLVE_FAILURE (1)
@@ -106,6 +173,16 @@ int chm_resolve_object(struct chmFile *h,
                        const char *objPath,
                        struct chmUnitInfo *ui);
 
+/* resolve several objects at once, reading each directory page at most
+ * once.  Sets results[i] to CHM_RESOLVE_SUCCESS or CHM_RESOLVE_FAILURE for
+ * each path, and returns how many were resolved.
+ */
+int chm_resolve_objects(struct chmFile *h,
+                        const char **objPaths,
+                        struct chmUnitInfo *uis,
+                        int *results,
+                        int count);
+
 /* retrieve part of an object from the archive */
 LONGINT64 chm_retrieve_object(struct chmFile *h,
                               struct chmUnitInfo *ui,
@@ -113,6 +190,60 @@ LONGINT64 chm_retrieve_object(struct chmFile *h,
                               LONGUINT64 addr,
                               LONGINT64 len);
 
+/* retrieve parts of several objects at once; each block of compressed
+ * data is decompressed at most once, however many of the objects share
+ * it.  Sets the result of each request to the number of bytes retrieved,
+ * and returns the number of requests retrieved in full.
+ */
+struct chmRetrieval
+{
+    struct chmUnitInfo *ui;
+    unsigned char      *buf;
+    LONGUINT64          addr;
+    LONGINT64           len;
+    LONGINT64           result;
+};
+int chm_retrieve_objects(struct chmFile *h,
+                         struct chmRetrieval *reqs,
+                         int count);
+
+/* stream part of an object to a sink, a block at a time, so that it
+ * never has to be held in memory whole.  The sink is handed each span as
+ * soon as it is ready; the span is only valid for the duration of the
+ * call.  Returns the number of bytes handed to the sink, which stops
+ * short if the sink returns CHM_SINK_STOP, or -1 if it returns
+ * CHM_SINK_FAILURE.
+ */
+typedef int (*CHM_SINK)(struct chmFile *h,
+                        const unsigned char *buf,
+                        LONGINT64 len,
+                        void *context);
+#define CHM_SINK_FAILURE        (0)
+#define CHM_SINK_CONTINUE       (1)
+#define CHM_SINK_STOP           (2)
+LONGINT64 chm_stream_object(struct chmFile *h,
+                            struct chmUnitInfo *ui,
+                            LONGUINT64 addr,
+                            LONGINT64 len,
+                            CHM_SINK sink,
+                            void *context);
+
+/* get a read-only view of part of an object without decompressing it.
+ * Only works for objects in the uncompressed space; for mapped archives
+ * (CHM_OPEN_MMAP) the view points straight into the mapping, otherwise
+ * it is a private copy.  Returns the length of the view, or 0 if the
+ * object cannot be viewed, in which case chm_retrieve_object must be used.
+ * Every view must be released with chm_release_view before chm_close.
+ */
+LONGINT64 chm_view_object(struct chmFile *h,
+                          struct chmUnitInfo *ui,
+                          const unsigned char **view,
+                          LONGUINT64 addr,
+                          LONGINT64 len);
+
+void chm_release_view(struct chmFile *h,
+                      const unsigned char *view);
+
 /* enumerate the objects in the .chm archive */
 typedef int (*CHM_ENUMERATOR)(struct chmFile *h,
                               struct chmUnitInfo *ui,
@@ -137,6 +268,27 @@ int chm_enumerate_dir(struct chmFile *h,
                       CHM_ENUMERATOR e,
                       void *context);
 
+/* extract every object of the given kinds (as for chm_enumerate), with
+ * the reset intervals of the compressed section decoded in parallel on up
+ * to the given number of threads.  The extractor is handed each piece of
+ * each object as it is decoded, from any of the threads and in no
+ * particular order, and once more with a NULL buf when the object is
+ * complete.  Pieces are only valid for the duration of the call; anything
+ * but CHM_SINK_CONTINUE stops the extraction.  Returns the number of
+ * objects extracted in full.
+ */
+typedef int (*CHM_EXTRACTOR)(struct chmFile *h,
+                             struct chmUnitInfo *ui,
+                             LONGUINT64 addr,
+                             const unsigned char *buf,
+                             LONGINT64 len,
+                             void *context);
+int chm_extract(struct chmFile *h,
+                int what,
+                int threads,
+                CHM_EXTRACTOR e,
+                void *context);
+
 #ifdef __cplusplus
 }
 #endif
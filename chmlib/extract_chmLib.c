@@ -0,0 +1,206 @@
+/***************************************************************************
+ *          extract_chmLib.c - CHM archive extraction tool                 *
+ *                           -------------------                           *
+ *                                                                         *
+ *  notes:      Extracts every file in a .chm archive into a directory,    *
+ *              decoding the reset intervals of the compressed section on  *
+ *              several threads at once (see chm_extract), and reports the *
+ *              throughput; with -n, nothing is written, which measures    *
+ *              decompression alone.  Linux only.  Build with:             *
+ *                                                                         *
+ *              cc -O2 -DCHM_MT -DCHM_USE_PREAD -o extract_chmLib          *
+ *                 extract_chmLib.c chm_lib.c lzx.c -lpthread              *
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License as        *
+ *   published by the Free Software Foundation; either version 2.1 of the  *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ ***************************************************************************/
+
+#define _XOPEN_SOURCE 500
+#include "chm_lib.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+struct extract_context
+{
+    const char         *base;
+    int                 dry_run;
+    unsigned long       files;
+    unsigned long long  bytes;
+    unsigned long       errors;
+};
+
+/* refuse paths which would escape the output directory */
+static int _safe_path(const char *path)
+{
+    const char *p = path;
+    while ((p = strstr(p, "..")) != NULL)
+    {
+        if ((p == path  ||  p[-1] == '/')  &&  (p[2] == '\0'  ||  p[2] == '/'))
+            return 0;
+        p += 2;
+    }
+    return 1;
+}
+
+/* create every directory leading up to path */
+static int _make_parents(char *path)
+{
+    char *p;
+    for (p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/'))
+    {
+        *p = '\0';
+        if (mkdir(path, 0777) != 0  &&  errno != EEXIST)
+        {
+            *p = '/';
+            return 0;
+        }
+        *p = '/';
+    }
+    return 1;
+}
+
+static int _open_output(char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT, 0666);
+    if (fd == -1  &&  errno == ENOENT  &&  _make_parents(path))
+        fd = open(path, O_WRONLY | O_CREAT, 0666);
+    return fd;
+}
+
+/* called from any of the extraction threads */
+static int _extract_callback(struct chmFile *h,
+                             struct chmUnitInfo *ui,
+                             LONGUINT64 addr,
+                             const unsigned char *buf,
+                             LONGINT64 len,
+                             void *context)
+{
+    struct extract_context *ctx = (struct extract_context *)context;
+    char path[1024];
+    int fd, ok = 1;
+
+    (void)h;
+    if (ctx->dry_run)
+    {
+        if (buf != NULL)
+            __sync_fetch_and_add(&ctx->bytes, (unsigned long long)len);
+        else
+            __sync_fetch_and_add(&ctx->files, 1);
+        return CHM_SINK_CONTINUE;
+    }
+    if (ui->path[0] != '/'  ||  ! _safe_path(ui->path))
+        return CHM_SINK_CONTINUE;
+    if (snprintf(path, sizeof(path), "%s%s", ctx->base, ui->path)
+            >= (int)sizeof(path))
+    {
+        __sync_fetch_and_add(&ctx->errors, 1);
+        return CHM_SINK_CONTINUE;
+    }
+
+    /* directories */
+    if (ui->path[strlen(ui->path) - 1] == '/')
+    {
+        if (buf == NULL  &&  ! _make_parents(path))
+            __sync_fetch_and_add(&ctx->errors, 1);
+        return CHM_SINK_CONTINUE;
+    }
+
+    /* pieces arrive in no particular order, so each is written in place,
+     * and the file is cut to length once complete
+     */
+    fd = _open_output(path);
+    if (fd == -1)
+        ok = 0;
+    else
+    {
+        if (buf != NULL)
+            ok = pwrite(fd, buf, (size_t)len, (off_t)addr) == (ssize_t)len;
+        else
+            ok = ftruncate(fd, (off_t)ui->length) == 0;
+        close(fd);
+    }
+
+    if (! ok)
+        __sync_fetch_and_add(&ctx->errors, 1);
+    else if (buf != NULL)
+        __sync_fetch_and_add(&ctx->bytes, (unsigned long long)len);
+    else
+        __sync_fetch_and_add(&ctx->files, 1);
+    return CHM_SINK_CONTINUE;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-n] [-t threads] <chmfile> <outdir>\n", argv0);
+    exit(1);
+}
+
+int main(int c, char **v)
+{
+    struct chmFile *h;
+    struct extract_context ctx;
+    struct timeval start, end;
+    double elapsed;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int dry_run = 0;
+    int opt;
+
+    while ((opt = getopt(c, v, "nt:")) != -1)
+    {
+        if (opt == 'n')
+            dry_run = 1;
+        else if (opt == 't')
+            threads = atoi(optarg);
+        else
+            usage(v[0]);
+    }
+    if (c - optind != 2  ||  threads < 1)
+        usage(v[0]);
+
+    h = chm_open_ex(v[optind], CHM_OPEN_MMAP);
+    if (h == NULL)
+    {
+        fprintf(stderr, "failed to open %s\n", v[optind]);
+        exit(1);
+    }
+    if (! dry_run  &&  mkdir(v[optind + 1], 0777) != 0  &&  errno != EEXIST)
+    {
+        perror(v[optind + 1]);
+        exit(1);
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.base = v[optind + 1];
+    ctx.dry_run = dry_run;
+
+    gettimeofday(&start, NULL);
+    chm_extract(h, CHM_ENUMERATE_NORMAL | CHM_ENUMERATE_SPECIAL, threads,
+                _extract_callback, &ctx);
+    gettimeofday(&end, NULL);
+    chm_close(h);
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%s: %lu files, %llu bytes in %.3f s (%.1f MiB/s, %d threads)\n",
+           v[optind], ctx.files, ctx.bytes, elapsed,
+           elapsed > 0 ? ctx.bytes / elapsed / (1024 * 1024) : 0.0, threads);
+    if (ctx.errors)
+    {
+        fprintf(stderr, "%lu errors\n", ctx.errors);
+        return 1;
+    }
+    return 0;
+}
@@ -38,11 +38,40 @@
 #define memcpy __builtin_memcpy
 #endif
 
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /* sized types */
 typedef unsigned char  UBYTE; /* 8 bits exactly    */
 typedef unsigned short UWORD; /* 16 bits (or more) */
 typedef unsigned int   ULONG; /* 32 bits (or more) */
 typedef   signed int    LONG; /* 32 bits (or more) */
+#ifdef _MSC_VER
+typedef unsigned __int64 UQUAD; /* 64 bits exactly */
+#else
+typedef unsigned long long UQUAD; /* 64 bits exactly */
+#endif
+
+/* LZX_SPECIALIZE builds a decoder for each window size, with the size
+ * built in, instead of one which reads it from the state.  It makes for
+ * several times the code, and no measurable speedup with gcc, so is off
+ * by default.
+ */
+#ifndef LZX_SPECIALIZE
+#define LZX_SPECIALIZE 0
+#endif
+
+/* for the decoder core, which must be inlined to be specialized */
+#if defined(__GNUC__)
+#define LZX_INLINE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define LZX_INLINE static __forceinline
+#else
+#define LZX_INLINE static
+#endif
 
 /* some constants defined by the LZX specification */
 #define LZX_MIN_MATCH                (2)
@@ -57,28 +86,78 @@ typedef   signed int    LONG; /* 32 bits (or more) */
 #define LZX_NUM_PRIMARY_LENGTHS      (7)   /* this one missing from spec! */
 #define LZX_NUM_SECONDARY_LENGTHS    (249) /* length tree #elements */
 
-/* LZX huffman defines: tweak tablebits as desired */
+/* position slots, and so main tree elements, for a window of 2^w bytes */
+#define LZX_POSN_SLOTS(w)    ((w) == 20 ? 42 : (w) == 21 ? 50 : (w) << 1)
+/** alternatively **/
+/* posn_slots=i=0; while (i < wndsize) i += 1 << extra_bits[posn_slots++]; */
+#define LZX_MAIN_ELEMENTS(w) (LZX_NUM_CHARS + (LZX_POSN_SLOTS(w) << 3))
+
+/* LZX huffman defines: tweak tablebits and pairs as desired.  Tables are
+ * rebuilt for every block, which in a CHM file is often every frame, so
+ * a first level much larger than the commonest codes costs more to fill
+ * than it saves; for the same reason, pairs (see make_decode_table) only
+ * pay off on long blocks that are mostly literals.
+ */
 #define LZX_PRETREE_MAXSYMBOLS  (LZX_PRETREE_NUM_ELEMENTS)
 #define LZX_PRETREE_TABLEBITS   (6)
+#define LZX_PRETREE_MAXCODELEN  (15) /* lengths are 4 bits */
+#define LZX_PRETREE_PAIRS       (0)
 #define LZX_MAINTREE_MAXSYMBOLS (LZX_NUM_CHARS + 50*8)
-#define LZX_MAINTREE_TABLEBITS  (12)
+#define LZX_MAINTREE_TABLEBITS  (11)
+#define LZX_MAINTREE_MAXCODELEN (16)
+#ifndef LZX_MAINTREE_PAIRS   /* decode two literals at once; the only */
+#define LZX_MAINTREE_PAIRS      (0)  /* tree whose loops handle pairs */
+#endif
 #define LZX_LENGTH_MAXSYMBOLS   (LZX_NUM_SECONDARY_LENGTHS+1)
-#define LZX_LENGTH_TABLEBITS    (12)
+#define LZX_LENGTH_TABLEBITS    (9)
+#define LZX_LENGTH_MAXCODELEN   (16)
+#define LZX_LENGTH_PAIRS        (0)
 #define LZX_ALIGNED_MAXSYMBOLS  (LZX_ALIGNED_NUM_ELEMENTS)
 #define LZX_ALIGNED_TABLEBITS   (7)
+#define LZX_ALIGNED_MAXCODELEN  (7)  /* lengths are 3 bits */
+#define LZX_ALIGNED_PAIRS       (0)
 
 #define LZX_LENTABLE_SAFETY (64) /* we allow length table decoding overruns */
+#define LZX_MAX_CODELEN     (16) /* no huffman code is longer than this */
+
+/* a decoding table is a first level of 2^tablebits entries, followed by
+ * second-level tables for the longer codes.  Each of those holds at least
+ * one more code than it has index bits, which bounds the room they need
+ */
+#define LZX_SUBTABLE_ENTRIES(tbl) \
+  (LZX_##tbl##_MAXCODELEN <= LZX_##tbl##_TABLEBITS ? 0 : \
+   LZX_##tbl##_MAXSYMBOLS * (1 << (LZX_##tbl##_MAXCODELEN - LZX_##tbl##_TABLEBITS)) \
+   / (LZX_##tbl##_MAXCODELEN + 1 - LZX_##tbl##_TABLEBITS))
 
 #define LZX_DECLARE_TABLE(tbl) \
-  UWORD tbl##_table[(1<<LZX_##tbl##_TABLEBITS) + (LZX_##tbl##_MAXSYMBOLS<<1)];\
+  ULONG tbl##_table[(1<<LZX_##tbl##_TABLEBITS) + LZX_SUBTABLE_ENTRIES(tbl)];\
   UBYTE tbl##_len  [LZX_##tbl##_MAXSYMBOLS + LZX_LENTABLE_SAFETY]
 
+/* decoding table entries.  A leaf holds a symbol and the length of its
+ * code; a link holds the offset of a second-level table and the number
+ * of bits which index it; a pair holds two literals, the length of the
+ * first one's code, and the length of both codes together.
+ */
+#define HUFF_LINK       (0x80000000)
+#define HUFF_PAIR       (0x40000000)
+#define HUFF_SYM(e)     ((e) & 0xFFFF)     /* leaf symbol, or link offset */
+#define HUFF_LEN(e)     (((e) >> 16) & 31) /* code length, or link bits  */
+#define HUFF_PAIRLEN(e) (((e) >> 21) & 31) /* a pair's combined length   */
+
+struct LZXstate;
+
+/* a decoder for one window size, or for any; see LZX_DECOMPRESSOR */
+typedef int (*lzx_decompressor)(struct LZXstate *pState, UBYTE *inpos, UBYTE *outpos,
+                                int inlen, int outlen, UBYTE **view);
+
 struct LZXstate
 {
+    lzx_decompressor decompress; /* the one for this window size  */
     UBYTE *window;         /* the actual decoding window              */
     ULONG window_size;     /* window size (32Kb through 2Mb)          */
     ULONG actual_size;     /* window size when it was first allocated */
     ULONG window_posn;     /* current offset within the window        */
+    ULONG window_used;     /* bytes written since reset, up to size   */
     ULONG R0, R1, R2;      /* for the LRU offset system               */
     UWORD main_elements;   /* number of main tree elements            */
     int   header_read;     /* have we started decoding at all yet?    */
@@ -165,11 +244,32 @@ static const ULONG position_base[51] = {
     1835008, 1966080, 2097152
 };
 
+#define LZX_DECLARE_DECOMPRESSOR(bits) \
+  static int lzx_decompress_##bits(struct LZXstate *pState, UBYTE *inpos, UBYTE *outpos, \
+                                   int inlen, int outlen, UBYTE **view)
+
+#if LZX_SPECIALIZE
+LZX_DECLARE_DECOMPRESSOR(15);
+LZX_DECLARE_DECOMPRESSOR(16);
+LZX_DECLARE_DECOMPRESSOR(17);
+LZX_DECLARE_DECOMPRESSOR(18);
+LZX_DECLARE_DECOMPRESSOR(19);
+LZX_DECLARE_DECOMPRESSOR(20);
+LZX_DECLARE_DECOMPRESSOR(21);
+
+static const lzx_decompressor lzx_decompressors[] = {
+    lzx_decompress_15, lzx_decompress_16, lzx_decompress_17, lzx_decompress_18,
+    lzx_decompress_19, lzx_decompress_20, lzx_decompress_21
+};
+#else
+LZX_DECLARE_DECOMPRESSOR(0);
+#endif
+
 struct LZXstate *LZXinit(int window)
 {
     struct LZXstate *pState=NULL;
     ULONG wndsize = 1 << window;
-    int i, posn_slots;
+    int i;
 
     /* LZX supports window sizes of 2^15 (32Kb) through 2^21 (2Mb) */
     /* if a previously allocated window is big enough, keep it     */
@@ -185,17 +285,16 @@ struct LZXstate *LZXinit(int window)
     pState->actual_size = wndsize;
     pState->window_size = wndsize;
 
-    /* calculate required position slots */
-    if (window == 20) posn_slots = 42;
-    else if (window == 21) posn_slots = 50;
-    else posn_slots = window << 1;
-
-    /** alternatively **/
-    /* posn_slots=i=0; while (i < wndsize) i += 1 << extra_bits[posn_slots++]; */
+    /* pick the decoder, which may have the window size built in */
+#if LZX_SPECIALIZE
+    pState->decompress = lzx_decompressors[window - 15];
+#else
+    pState->decompress = lzx_decompress_0;
+#endif
 
     /* initialize other state */
     pState->R0  =  pState->R1  = pState->R2 = 1;
-    pState->main_elements   = LZX_NUM_CHARS + (posn_slots << 3);
+    pState->main_elements   = LZX_MAIN_ELEMENTS(window);
     pState->header_read     = 0;
     pState->frames_read     = 0;
     pState->block_remaining = 0;
@@ -203,6 +302,7 @@ struct LZXstate *LZXinit(int window)
     pState->intel_curpos    = 0;
     pState->intel_started   = 0;
     pState->window_posn     = 0;
+    pState->window_used     = 0;
 
     /* initialise tables to 0 (because deltas will be applied to them) */
     for (i = 0; i < LZX_MAINTREE_MAXSYMBOLS; i++) pState->MAINTREE_len[i] = 0;
@@ -233,6 +333,7 @@ int LZXreset(struct LZXstate *pState)
     pState->intel_curpos    = 0;
     pState->intel_started   = 0;
     pState->window_posn     = 0;
+    pState->window_used     = 0;
 
     for (i = 0; i < LZX_MAINTREE_MAXSYMBOLS + LZX_LENTABLE_SAFETY; i++) pState->MAINTREE_len[i] = 0;
     for (i = 0; i < LZX_LENGTH_MAXSYMBOLS + LZX_LENTABLE_SAFETY; i++)   pState->LENGTH_len[i]   = 0;
@@ -240,6 +341,60 @@ int LZXreset(struct LZXstate *pState)
     return DECR_OK;
 }
 
+unsigned long LZXstatesize(struct LZXstate *pState)
+{
+    return sizeof(struct LZXstate) + pState->actual_size;
+}
+
+/* a saved copy of an lzx stream's state, taken between two calls to
+ * LZXdecompress.  Only the part of the window written since the last
+ * reset is kept; it follows the structure.
+ */
+struct LZXcheckpoint
+{
+    struct LZXstate state;
+    ULONG window_len;
+};
+
+struct LZXcheckpoint *LZXcheckpoint(struct LZXstate *pState)
+{
+    struct LZXcheckpoint *pCheckpoint;
+    ULONG len = pState->window_used;
+
+    pCheckpoint = (struct LZXcheckpoint *)malloc(sizeof(struct LZXcheckpoint) + len);
+    if (!pCheckpoint) return NULL;
+
+    pCheckpoint->state = *pState;
+    pCheckpoint->state.window = NULL;
+    pCheckpoint->window_len = len;
+    memcpy(pCheckpoint + 1, pState->window, (size_t) len);
+    return pCheckpoint;
+}
+
+unsigned long LZXcheckpointsize(struct LZXcheckpoint *pCheckpoint)
+{
+    return sizeof(struct LZXcheckpoint) + pCheckpoint->window_len;
+}
+
+int LZXrestore(struct LZXstate *pState, struct LZXcheckpoint *pCheckpoint)
+{
+    UBYTE *window = pState->window;
+    ULONG actual_size = pState->actual_size;
+
+    if (pCheckpoint->state.window_size != pState->window_size) return DECR_DATAFORMAT;
+
+    *pState = pCheckpoint->state;
+    pState->window = window;
+    pState->actual_size = actual_size;
+    memcpy(window, pCheckpoint + 1, (size_t) pCheckpoint->window_len);
+    return DECR_OK;
+}
+
+void LZXfreecheckpoint(struct LZXcheckpoint *pCheckpoint)
+{
+    free(pCheckpoint);
+}
+
 
 /* Bitstream reading macros:
  *
@@ -253,26 +408,55 @@ int LZXreset(struct LZXstate *pState)
  * These bit access routines work by using the area beyond the MSB and the
  * LSB as a free source of zeroes. This avoids having to mask any bits.
  * So we have to know the bit width of the bitbuffer variable. This is
- * sizeof(ULONG) * 8, also defined as ULONG_BITS
+ * sizeof(UQUAD) * 8, also defined as BITBUF_BITS
  */
 
-/* number of bits in ULONG. Note: This must be at multiple of 16, and at
- * least 32 for the bitbuffer code to work (ie, it must be able to ensure
- * up to 17 bits - that's adding 16 bits when there's one bit left, or
- * adding 32 bits when there are no bits left. The code should work fine
- * for machines where ULONG >= 32 bits.
+/* number of bits in the bit buffer.  No more than 17 bits are ever asked
+ * for at once, so a refill happens with at most 16 bits left, and always
+ * has room for three more 16-bit words.
  */
-#define ULONG_BITS (sizeof(ULONG)<<3)
+#define BITBUF_BITS (sizeof(UQUAD)<<3)
 
 #define INIT_BITSTREAM do { bitsleft = 0; bitbuf = 0; } while (0)
 
-#define ENSURE_BITS(n)							\
-  while (bitsleft < (n)) {						\
-    bitbuf |= ((inpos[1]<<8)|inpos[0]) << (ULONG_BITS-16 - bitsleft);	\
-    bitsleft += 16; inpos+=2;						\
-  }
+/* the next 16-bit word of input, as an unsigned value */
+#define INPUT_WORD(p) ((UQUAD)(((p)[1]<<8)|(p)[0]))
+
+/* FILL_BITS tops the buffer up with 48 bits.  Well clear of the end of the
+ * input, that is three words read without any checks; near the end, it is
+ * lzx_fill_tail, with zeroes standing in for what isn't there.  inpos
+ * moves on either way, so running off the end is still noticed.
+ */
+#define FILL_BITS do {							\
+  if (endinp - inpos >= 6) {						\
+    bitbuf |= INPUT_WORD(inpos)   << (BITBUF_BITS-16 - bitsleft)	\
+           |  INPUT_WORD(inpos+2) << (BITBUF_BITS-32 - bitsleft)	\
+           |  INPUT_WORD(inpos+4) << (BITBUF_BITS-48 - bitsleft);	\
+  }									\
+  else {								\
+    bitbuf |= lzx_fill_tail(inpos, endinp) >> bitsleft;		\
+  }									\
+  inpos += 6; bitsleft += 48;						\
+} while (0)
+
+/* the last few words of input, left-aligned, as FILL_BITS would take them */
+static UQUAD lzx_fill_tail(UBYTE *inpos, UBYTE *endinp)
+{
+    UQUAD bits = 0;
+    int shift;
+
+    for (shift = BITBUF_BITS-16; shift >= (int)BITBUF_BITS-48; shift -= 16, inpos += 2) {
+        if (endinp - inpos >= 2)
+            bits |= INPUT_WORD(inpos) << shift;
+        else if (endinp - inpos == 1)
+            bits |= (UQUAD)inpos[0] << shift;
+    }
+    return bits;
+}
+
+#define ENSURE_BITS(n) do { if (bitsleft < (n)) FILL_BITS; } while (0)
 
-#define PEEK_BITS(n)   (bitbuf >> (ULONG_BITS - (n)))
+#define PEEK_BITS(n)   ((ULONG)(bitbuf >> (BITBUF_BITS - (n))))
 #define REMOVE_BITS(n) ((bitbuf <<= (n)), (bitsleft -= (n)))
 
 #define READ_BITS(v,n) do {						\
@@ -285,6 +469,7 @@ int LZXreset(struct LZXstate *pState)
 /* Huffman macros */
 
 #define TABLEBITS(tbl)   (LZX_##tbl##_TABLEBITS)
+#define PAIRS(tbl)       (LZX_##tbl##_PAIRS)
 #define MAXSYMBOLS(tbl)  (LZX_##tbl##_MAXSYMBOLS)
 #define SYMTABLE(tbl)    (pState->tbl##_table)
 #define LENTABLE(tbl)    (pState->tbl##_len)
@@ -296,25 +481,37 @@ int LZXreset(struct LZXstate *pState)
  */
 #define BUILD_TABLE(tbl)						\
   if (make_decode_table(						\
-    MAXSYMBOLS(tbl), TABLEBITS(tbl), LENTABLE(tbl), SYMTABLE(tbl)	\
+    MAXSYMBOLS(tbl), TABLEBITS(tbl), LENTABLE(tbl), SYMTABLE(tbl),	\
+    PAIRS(tbl)								\
   )) { return DECR_ILLEGALDATA; }
 
 
 /* READ_HUFFSYM(tablename, var) decodes one huffman symbol from the
- * bitstream using the stated table and puts it in var.
+ * bitstream using the stated table and puts it in var.  Codes are never
+ * longer than 16 bits, so one or two lookups always find the symbol.
+ *
+ * It is LOOKUP_HUFFSYM, which leaves the first-level entry in i, then
+ * FINISH_HUFFSYM, which follows a link if need be and takes the code's
+ * bits.  The main tree's pairs are dealt with in between, by the caller.
  */
-#define READ_HUFFSYM(tbl,var) do {					\
+#define LOOKUP_HUFFSYM(tbl) do {					\
   ENSURE_BITS(16);							\
   hufftbl = SYMTABLE(tbl);						\
-  if ((i = hufftbl[PEEK_BITS(TABLEBITS(tbl))]) >= MAXSYMBOLS(tbl)) {	\
-    j = 1 << (ULONG_BITS - TABLEBITS(tbl));				\
-    do {								\
-      j >>= 1; i <<= 1; i |= (bitbuf & j) ? 1 : 0;			\
-      if (!j) { return DECR_ILLEGALDATA; }	                        \
-    } while ((i = hufftbl[i]) >= MAXSYMBOLS(tbl));			\
+  i = hufftbl[PEEK_BITS(TABLEBITS(tbl))];				\
+} while (0)
+
+#define FINISH_HUFFSYM(tbl,var) do {					\
+  if (i & HUFF_LINK) {							\
+    i = hufftbl[HUFF_SYM(i) + (PEEK_BITS(TABLEBITS(tbl) + HUFF_LEN(i))	\
+                               & ((1 << HUFF_LEN(i)) - 1))];		\
   }									\
-  j = LENTABLE(tbl)[(var) = i];						\
-  REMOVE_BITS(j);							\
+  (var) = HUFF_SYM(i);							\
+  REMOVE_BITS(HUFF_LEN(i));						\
+} while (0)
+
+#define READ_HUFFSYM(tbl,var) do {					\
+  LOOKUP_HUFFSYM(tbl);							\
+  FINISH_HUFFSYM(tbl,var);						\
 } while (0)
 
 
@@ -323,7 +520,7 @@ int LZXreset(struct LZXstate *pState)
  * own special LZX way.
  */
 #define READ_LENGTHS(tbl,first,last) do { \
-  lb.bb = bitbuf; lb.bl = bitsleft; lb.ip = inpos; \
+  lb.bb = bitbuf; lb.bl = bitsleft; lb.ip = inpos; lb.ep = endinp; \
   if (lzx_read_lens(pState, LENTABLE(tbl),(first),(last),&lb)) { \
     return DECR_ILLEGALDATA; \
   } \
@@ -331,104 +528,142 @@ int LZXreset(struct LZXstate *pState)
 } while (0)
 
 
-/* make_decode_table(nsyms, nbits, length[], table[])
+/* make_decode_table(nsyms, nbits, length[], table[], pairs)
  *
- * This function was coded by David Tritscher. It builds a fast huffman
- * decoding table out of just a canonical huffman code lengths table.
+ * This builds a two-level huffman decoding table out of just a canonical
+ * huffman code lengths table.  The first nbits bits of input index the
+ * first level, where codes that short are found directly.  Longer codes
+ * find a link there to a second-level table, indexed by the bits which
+ * follow, and only as large as the longest code beneath that link needs.
  *
  * nsyms  = total number of symbols in this huffman tree.
  * nbits  = any symbols with a code length of nbits or less can be decoded
  *          in one lookup of the table.
  * length = A table to get code lengths from [0 to syms-1]
- * table  = The table to fill up with decoded symbols and pointers.
+ * table  = The table to fill up with decoded symbols and links.
+ * pairs  = if set, first-level entries whose nbits cover the codes of two
+ *          literals in a row decode both at once.
  *
  * Returns 0 for OK or 1 for error
  */
 
-static int make_decode_table(ULONG nsyms, ULONG nbits, UBYTE *length, UWORD *table) {
-    register UWORD sym;
-    register ULONG leaf;
-    register UBYTE bit_num = 1;
-    ULONG fill;
-    ULONG pos         = 0; /* the current position in the decode table */
-    ULONG table_mask  = 1 << nbits;
-    ULONG bit_mask    = table_mask >> 1; /* don't do 0 length codes */
-    ULONG next_symbol = bit_mask; /* base of allocation for long codes */
+static int make_decode_table(ULONG nsyms, ULONG nbits, UBYTE *length, ULONG *table, int pairs) {
+    UWORD count[LZX_MAX_CODELEN + 1];
+    UWORD offs[LZX_MAX_CODELEN + 1];
+    UWORD sorted[LZX_MAINTREE_MAXSYMBOLS];
+    ULONG sym, len, sym2, len2, n, fill, leaf, e;
+    ULONG code      = 0;
+    ULONG prefix    = ~(ULONG)0; /* the link the last long code went under */
+    ULONG sub       = 0;          /* base of that link's table */
+    ULONG sub_bits  = 0;          /* and its index bits */
+    ULONG next      = 1 << nbits; /* base of allocation for long codes */
+    ULONG mask      = next - 1;
+    LONG left;
+
+    for (len = 0; len <= LZX_MAX_CODELEN; len++) count[len] = 0;
+    for (sym = 0; sym < nsyms; sym++) {
+        if (length[sym] > LZX_MAX_CODELEN) return 1;
+        count[length[sym]]++;
+    }
 
-    /* fill entries for codes short enough for a direct mapping */
-    while (bit_num <= nbits) {
-        for (sym = 0; sym < nsyms; sym++) {
-            if (length[sym] == bit_num) {
-                leaf = pos;
+    /* the code must fill the code space exactly, unless it is empty */
+    left = 1;
+    for (len = 1; len <= LZX_MAX_CODELEN; len++) {
+        left = (left << 1) - count[len];
+        if (left < 0) return 1; /* over-subscribed */
+    }
+    if (left > 0) {
+        if (count[0] != nsyms) return 1; /* incomplete */
 
-                if((pos += bit_mask) > table_mask) return 1; /* table overrun */
+        /* all elements are 0: every lookup gives symbol 0, taking no bits */
+        for (n = 0; n <= mask; n++) table[n] = 0;
+        return 0;
+    }
 
-                /* fill all possible lookups of this symbol with the symbol itself */
-                fill = bit_mask;
-                while (fill-- > 0) table[leaf++] = sym;
-            }
-        }
-        bit_mask >>= 1;
-        bit_num++;
+    /* put the symbols in code order: by length, then by symbol */
+    offs[1] = 0;
+    for (len = 1; len < LZX_MAX_CODELEN; len++) offs[len + 1] = offs[len] + count[len];
+    for (sym = 0; sym < nsyms; sym++) {
+        if (length[sym]) sorted[offs[length[sym]]++] = (UWORD) sym;
     }
 
-    /* if there are any codes longer than nbits */
-    if (pos != table_mask) {
-        /* clear the remainder of the table */
-        for (sym = pos; sym < table_mask; sym++) table[sym] = 0;
-
-        /* give ourselves room for codes to grow by up to 16 more bits */
-        pos <<= 16;
-        table_mask <<= 16;
-        bit_mask = 1 << 15;
-
-        while (bit_num <= 16) {
-            for (sym = 0; sym < nsyms; sym++) {
-                if (length[sym] == bit_num) {
-                    leaf = pos >> 16;
-                    for (fill = 0; fill < bit_num - nbits; fill++) {
-                        /* if this path hasn't been taken yet, 'allocate' two entries */
-                        if (table[leaf] == 0) {
-                            table[(next_symbol << 1)] = 0;
-                            table[(next_symbol << 1) + 1] = 0;
-                            table[leaf] = next_symbol++;
-                        }
-                        /* follow the path and select either left or right for next bit */
-                        leaf = table[leaf] << 1;
-                        if ((pos >> (15-fill)) & 1) leaf++;
-                    }
-                    table[leaf] = sym;
+    /* and hand out codes in that order */
+    n = 0;
+    for (len = 1; len <= LZX_MAX_CODELEN; len++, code <<= 1) {
+        for (fill = count[len]; fill > 0; fill--, code++) {
+            sym = sorted[n++];
 
-                    if ((pos += bit_mask) > table_mask) return 1; /* table overflow */
+            if (len <= nbits) {
+                /* fill all possible lookups of this symbol with the symbol itself */
+                leaf = code << (nbits - len);
+                e = leaf + (1 << (nbits - len));
+                while (leaf < e) table[leaf++] = sym | (len << 16);
+                continue;
+            }
+
+            if ((code >> (len - nbits)) != prefix) {
+                /* a new link: its table needs as many bits as it takes for
+                 * the codes beneath it to fill it, and codes come shortest
+                 * first, so keep adding bits until what's left runs out
+                 */
+                prefix = code >> (len - nbits);
+                sub_bits = len - nbits;
+                left = (1 << sub_bits) - fill;
+                for (len2 = len; left > 0 && len2 < LZX_MAX_CODELEN; ) {
+                    len2++; sub_bits++;
+                    left = (left << 1) - count[len2];
                 }
+                sub = next;
+                next += 1 << sub_bits;
+                table[prefix] = HUFF_LINK | sub | (sub_bits << 16);
             }
-            bit_mask >>= 1;
-            bit_num++;
+
+            leaf = sub + ((code & ((1 << (len - nbits)) - 1)) << (sub_bits - (len - nbits)));
+            e = leaf + (1 << (sub_bits - (len - nbits)));
+            while (leaf < e) table[leaf++] = sym | (len << 16);
         }
     }
 
-    /* full table? */
-    if (pos == table_mask) return 0;
-
-    /* either erroneous table, or all elements are 0 - let's find out. */
-    for (sym = 0; sym < nsyms; sym++) if (length[sym]) return 1;
+    /* pair up literals whose codes together fit in the first level.  The
+     * second code starts len bits into the index, and the entry found by
+     * shifting those bits away covers every value of the bits shifted in.
+     * It may already have been made a pair, but still starts the same way.
+     */
+    if (pairs) {
+        for (n = 0; n <= mask; n++) {
+            e = table[n];
+            len = HUFF_LEN(e);
+            if ((e & HUFF_LINK) || HUFF_SYM(e) >= LZX_NUM_CHARS || len >= nbits) continue;
+
+            e = table[(n << len) & mask];
+            if (e & HUFF_LINK) continue;
+            sym2 = e & ((e & HUFF_PAIR) ? 0xFF : 0xFFFF);
+            len2 = HUFF_LEN(e);
+            if (sym2 >= LZX_NUM_CHARS || len + len2 > nbits) continue;
+
+            table[n] = HUFF_PAIR | HUFF_SYM(table[n]) | (sym2 << 8)
+                     | (len << 16) | ((len + len2) << 21);
+        }
+    }
     return 0;
 }
 
 struct lzx_bits {
-  ULONG bb;
+  UQUAD bb;
   int bl;
   UBYTE *ip;
+  UBYTE *ep;
 };
 
 static int lzx_read_lens(struct LZXstate *pState, UBYTE *lens, ULONG first, ULONG last, struct lzx_bits *lb) {
-    ULONG i,j, x,y;
+    ULONG i, x,y;
     int z;
 
-    register ULONG bitbuf = lb->bb;
+    register UQUAD bitbuf = lb->bb;
     register int bitsleft = lb->bl;
     UBYTE *inpos = lb->ip;
-    UWORD *hufftbl;
+    UBYTE *endinp = lb->ep;
+    ULONG *hufftbl;
 
     for (x = 0; x < 20; x++) {
         READ_BITS(y, 4);
@@ -464,21 +699,97 @@ static int lzx_read_lens(struct LZXstate *pState, UBYTE *lens, ULONG first, ULON
     return 0;
 }
 
-int LZXdecompress(struct LZXstate *pState, unsigned char *inpos, unsigned char *outpos, int inlen, int outlen) {
+/* lzx_copy_match(dest, src, len) copies a match within the window, from
+ * src to dest, which lies after it.  The two overlap whenever the match
+ * offset is less than its length, which makes the source a repeating
+ * pattern: copies go eight bytes at a time when the offset allows it, and
+ * otherwise the pattern is doubled up until it does.  Nothing is written
+ * past dest + len, since once the window has wrapped that is still history.
+ */
+static void lzx_copy_match(UBYTE *dest, UBYTE *src, int len) {
+    ULONG offset = (ULONG)(dest - src);
+    UBYTE *end = dest + len;
+
+    if (offset == 1) {
+        memset(dest, src[0], (size_t) len);
+        return;
+    }
+
+    /* short offsets: copy the pattern onto itself, doubling it each time */
+    while (offset < 8) {
+        if ((ULONG)(end - dest) <= offset) {
+            memcpy(dest, src, (size_t)(end - dest));
+            return;
+        }
+        memcpy(dest, src, (size_t) offset);
+        dest += offset;
+        offset <<= 1;
+    }
+
+    /* then eight bytes at a time, finishing with an eight-byte copy that
+     * ends exactly at the end of the match; whatever it writes twice, it
+     * writes with the same bytes
+     */
+    src = dest - offset;
+    if (end - dest < 8) {
+        while (dest < end) *dest++ = *src++;
+        return;
+    }
+    while (end - dest > 8) {
+        memcpy(dest, src, 8);
+        dest += 8; src += 8;
+    }
+    memcpy(end - 8, end - 8 - offset, 8);
+}
+
+/* lzx_find_e8(p, end) returns the first 0xE8 byte in [p, end), or end if
+ * there is none.  Most output holds few of them, so the E8 pass below
+ * skips to each candidate, comparing 32 or 16 bytes at a time where the
+ * compiler targets AVX2 or SSE2.  Nothing at or past end is read.
+ */
+static UBYTE *lzx_find_e8(UBYTE *p, UBYTE *end) {
+#if defined(__GNUC__) && defined(__AVX2__)
+    const __m256i e8 = _mm256_set1_epi8((char) 0xE8);
+    while (end - p >= 32) {
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), e8));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+#elif defined(__GNUC__) && defined(__SSE2__)
+    const __m128i e8 = _mm_set1_epi8((char) 0xE8);
+    while (end - p >= 16) {
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), e8));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != 0xE8) p++;
+    return p;
+}
+
+/* lzx_decompress(..., window_bits) is the decoder proper.  It is only
+ * ever called with a constant window_bits, by the LZX_DECOMPRESSOR
+ * instances below, so that each has its window size, mask and main tree
+ * size built in; or with 0, in the one which reads them from pState.
+ */
+LZX_INLINE int lzx_decompress(struct LZXstate *pState, UBYTE *inpos, UBYTE *outpos, int inlen, int outlen, UBYTE **view, const int window_bits) {
     UBYTE *endinp = inpos + inlen;
     UBYTE *window = pState->window;
     UBYTE *runsrc, *rundest;
-    UWORD *hufftbl; /* used in READ_HUFFSYM macro as chosen decoding table */
+    ULONG *hufftbl; /* used in READ_HUFFSYM macro as chosen decoding table */
 
+    const ULONG window_size = window_bits ? (ULONG) 1 << window_bits : pState->window_size;
+    const ULONG main_elements = window_bits ? LZX_MAIN_ELEMENTS(window_bits) : pState->main_elements;
     ULONG window_posn = pState->window_posn;
-    ULONG window_size = pState->window_size;
     ULONG R0 = pState->R0;
     ULONG R1 = pState->R1;
     ULONG R2 = pState->R2;
 
-    register ULONG bitbuf;
+    register UQUAD bitbuf;
     register int bitsleft;
-    ULONG match_offset, i,j,k; /* ijk used in READ_HUFFSYM macro */
+    ULONG match_offset, i,j,k; /* i used in READ_HUFFSYM macro */
     struct lzx_bits lb; /* used in READ_LENGTHS macro */
 
     int togo = outlen, this_run, main_element, aligned_bits;
@@ -516,7 +827,7 @@ int LZXdecompress(struct LZXstate *pState, unsigned char *inpos, unsigned char *
 
                 case LZX_BLOCKTYPE_VERBATIM:
                     READ_LENGTHS(MAINTREE, 0, 256);
-                    READ_LENGTHS(MAINTREE, 256, pState->main_elements);
+                    READ_LENGTHS(MAINTREE, 256, main_elements);
                     BUILD_TABLE(MAINTREE);
                     if (LENTABLE(MAINTREE)[0xE8] != 0) pState->intel_started = 1;
 
@@ -527,7 +838,12 @@ int LZXdecompress(struct LZXstate *pState, unsigned char *inpos, unsigned char *
                 case LZX_BLOCKTYPE_UNCOMPRESSED:
                     pState->intel_started = 1; /* because we can't assume otherwise */
                     ENSURE_BITS(16); /* get up to 16 pad bits into the buffer */
-                    if (bitsleft > 16) inpos -= 2; /* and align the bitstream! */
+                    /* and align the bitstream: step back over the whole
+                     * words after the padding, which is the rest of the
+                     * current word, or all of it if aligned already
+                     */
+                    inpos -= (bitsleft - ((bitsleft & 15) ? (bitsleft & 15) : 16)) >> 3;
+                    if (endinp - inpos < 12) return DECR_ILLEGALDATA;
                     R0 = inpos[0]|(inpos[1]<<8)|(inpos[2]<<16)|(inpos[3]<<24);inpos+=4;
                     R1 = inpos[0]|(inpos[1]<<8)|(inpos[2]<<16)|(inpos[3]<<24);inpos+=4;
                     R2 = inpos[0]|(inpos[1]<<8)|(inpos[2]<<16)|(inpos[3]<<24);inpos+=4;
@@ -542,13 +858,13 @@ int LZXdecompress(struct LZXstate *pState, unsigned char *inpos, unsigned char *
         if (inpos > endinp) {
             /* it's possible to have a file where the next run is less than
              * 16 bits in size. In this case, the READ_HUFFSYM() macro used
-             * in building the tables will exhaust the buffer, so we should
-             * allow for this, but not allow those accidentally read bits to
-             * be used (so we check that there are at least 16 bits
-             * remaining - in this boundary case they aren't really part of
-             * the compressed data)
+             * in building the tables will read past the end of the buffer,
+             * so we should allow for this, but not allow those bits to
+             * have been used (so we check that the bits still buffered
+             * cover everything past the end - in this boundary case they
+             * aren't really part of the compressed data)
              */
-            if (inpos > (endinp+2) || bitsleft < 16) return DECR_ILLEGALDATA;
+            if ((inpos - endinp) * 8 > bitsleft) return DECR_ILLEGALDATA;
         }
 
         while ((this_run = pState->block_remaining) > 0 && togo > 0) {
@@ -566,7 +882,19 @@ int LZXdecompress(struct LZXstate *pState, unsigned char *inpos, unsigned char *
 
                 case LZX_BLOCKTYPE_VERBATIM:
                     while (this_run > 0) {
-                        READ_HUFFSYM(MAINTREE, main_element);
+                        LOOKUP_HUFFSYM(MAINTREE);
+                        if (PAIRS(MAINTREE) && (i & HUFF_PAIR)) {
+                            if (this_run >= 2) {
+                                /* two literals from one lookup */
+                                window[window_posn++] = (UBYTE) i;
+                                window[window_posn++] = (UBYTE) (i >> 8);
+                                REMOVE_BITS(HUFF_PAIRLEN(i));
+                                this_run -= 2;
+                                continue;
+                            }
+                            i = (i & 0xFF) | (HUFF_LEN(i) << 16); /* just the first */
+                        }
+                        FINISH_HUFFSYM(MAINTREE, main_element);
 
                         if (main_element < LZX_NUM_CHARS) {
                             /* literal: 0 to LZX_NUM_CHARS-1 */
@@ -616,14 +944,18 @@ int LZXdecompress(struct LZXstate *pState, unsigned char *inpos, unsigned char *
                             runsrc  = rundest - match_offset;
                             window_posn += match_length;
                             if (window_posn > window_size) return DECR_ILLEGALDATA;
+                            if (match_offset == 0 || match_offset > window_size) return DECR_ILLEGALDATA;
                             this_run -= match_length;
 
                             /* copy any wrapped around source data */
-                            while ((runsrc < window) && (match_length-- > 0)) {
-                                *rundest++ = *(runsrc + window_size); runsrc++;
+                            if (runsrc < window) {
+                                k = (ULONG)(window - runsrc);
+                                if (k > (ULONG)match_length) k = match_length;
+                                memmove(rundest, runsrc + window_size, (size_t) k);
+                                rundest += k; runsrc += k; match_length -= k;
                             }
                             /* copy match data - no worries about destination wraps */
-                            while (match_length-- > 0) *rundest++ = *runsrc++;
+                            if (match_length > 0) lzx_copy_match(rundest, runsrc, match_length);
 
                         }
                     }
@@ -631,7 +963,19 @@ int LZXdecompress(struct LZXstate *pState, unsigned char *inpos, unsigned char *
 
                 case LZX_BLOCKTYPE_ALIGNED:
                     while (this_run > 0) {
-                        READ_HUFFSYM(MAINTREE, main_element);
+                        LOOKUP_HUFFSYM(MAINTREE);
+                        if (PAIRS(MAINTREE) && (i & HUFF_PAIR)) {
+                            if (this_run >= 2) {
+                                /* two literals from one lookup */
+                                window[window_posn++] = (UBYTE) i;
+                                window[window_posn++] = (UBYTE) (i >> 8);
+                                REMOVE_BITS(HUFF_PAIRLEN(i));
+                                this_run -= 2;
+                                continue;
+                            }
+                            i = (i & 0xFF) | (HUFF_LEN(i) << 16); /* just the first */
+                        }
+                        FINISH_HUFFSYM(MAINTREE, main_element);
 
                         if (main_element < LZX_NUM_CHARS) {
                             /* literal: 0 to LZX_NUM_CHARS-1 */
@@ -697,14 +1041,18 @@ int LZXdecompress(struct LZXstate *pState, unsigned char *inpos, unsigned char *
                             runsrc  = rundest - match_offset;
                             window_posn += match_length;
                             if (window_posn > window_size) return DECR_ILLEGALDATA;
+                            if (match_offset == 0 || match_offset > window_size) return DECR_ILLEGALDATA;
                             this_run -= match_length;
 
                             /* copy any wrapped around source data */
-                            while ((runsrc < window) && (match_length-- > 0)) {
-                                *rundest++ = *(runsrc + window_size); runsrc++;
+                            if (runsrc < window) {
+                                k = (ULONG)(window - runsrc);
+                                if (k > (ULONG)match_length) k = match_length;
+                                memmove(rundest, runsrc + window_size, (size_t) k);
+                                rundest += k; runsrc += k; match_length -= k;
                             }
                             /* copy match data - no worries about destination wraps */
-                            while (match_length-- > 0) *rundest++ = *runsrc++;
+                            if (match_length > 0) lzx_copy_match(rundest, runsrc, match_length);
 
                         }
                     }
@@ -724,14 +1072,16 @@ int LZXdecompress(struct LZXstate *pState, unsigned char *inpos, unsigned char *
     }
 
     if (togo != 0) return DECR_ILLEGALDATA;
-    memcpy(outpos, window + ((!window_posn) ? window_size : window_posn) - outlen, (size_t) outlen);
+    runsrc = window + ((!window_posn) ? window_size : window_posn) - outlen;
 
     pState->window_posn = window_posn;
+    pState->window_used += outlen;
+    if (pState->window_used > window_size) pState->window_used = window_size;
     pState->R0 = R0;
     pState->R1 = R1;
     pState->R2 = R2;
 
-    /* intel E8 decoding */
+    /* intel E8 decoding, which must not touch the window */
     if ((pState->frames_read++ < 32768) && pState->intel_filesize != 0) {
         if (outlen <= 6 || !pState->intel_started) {
             pState->intel_curpos += outlen;
@@ -739,30 +1089,60 @@ int LZXdecompress(struct LZXstate *pState, unsigned char *inpos, unsigned char *
         else {
             UBYTE *data    = outpos;
             UBYTE *dataend = data + outlen - 10;
-            LONG curpos    = pState->intel_curpos;
+            LONG startpos  = pState->intel_curpos;
             LONG filesize  = pState->intel_filesize;
-            LONG abs_off, rel_off;
+            LONG curpos, abs_off, rel_off;
 
-            pState->intel_curpos = curpos + outlen;
+            pState->intel_curpos = startpos + outlen;
+            memcpy(outpos, runsrc, (size_t) outlen);
+            runsrc = outpos;
 
-            while (data < dataend) {
-                if (*data++ != 0xE8) { curpos++; continue; }
-                abs_off = data[0] | (data[1]<<8) | (data[2]<<16) | (data[3]<<24);
+            while ((data = lzx_find_e8(data, dataend)) < dataend) {
+                curpos = startpos + (LONG)(data - outpos);
+                abs_off = data[1] | (data[2]<<8) | (data[3]<<16) | (data[4]<<24);
                 if ((abs_off >= -curpos) && (abs_off < filesize)) {
                     rel_off = (abs_off >= 0) ? abs_off - curpos : abs_off + filesize;
-                    data[0] = (UBYTE) rel_off;
-                    data[1] = (UBYTE) (rel_off >> 8);
-                    data[2] = (UBYTE) (rel_off >> 16);
-                    data[3] = (UBYTE) (rel_off >> 24);
+                    data[1] = (UBYTE) rel_off;
+                    data[2] = (UBYTE) (rel_off >> 8);
+                    data[3] = (UBYTE) (rel_off >> 16);
+                    data[4] = (UBYTE) (rel_off >> 24);
                 }
-                data += 4;
-                curpos += 5;
+                data += 5;
             }
         }
     }
+
+    /* runsrc now points at the output, in the window or outpos */
+    if (view) *view = runsrc;
+    else if (runsrc != outpos) memcpy(outpos, runsrc, (size_t) outlen);
     return DECR_OK;
 }
 
+#define LZX_DECOMPRESSOR(bits) \
+  LZX_DECLARE_DECOMPRESSOR(bits) { \
+    return lzx_decompress(pState, inpos, outpos, inlen, outlen, view, bits); \
+  }
+
+#if LZX_SPECIALIZE
+LZX_DECOMPRESSOR(15)
+LZX_DECOMPRESSOR(16)
+LZX_DECOMPRESSOR(17)
+LZX_DECOMPRESSOR(18)
+LZX_DECOMPRESSOR(19)
+LZX_DECOMPRESSOR(20)
+LZX_DECOMPRESSOR(21)
+#else
+LZX_DECOMPRESSOR(0)
+#endif
+
+int LZXdecompress(struct LZXstate *pState, unsigned char *inpos, unsigned char *outpos, int inlen, int outlen) {
+    return pState->decompress(pState, inpos, outpos, inlen, outlen, NULL);
+}
+
+int LZXdecompressview(struct LZXstate *pState, unsigned char *inpos, unsigned char *outpos, int inlen, int outlen, unsigned char **view) {
+    return pState->decompress(pState, inpos, outpos, inlen, outlen, view);
+}
+
 #ifdef LZX_CHM_TESTDRIVER
 int main(int c, char **v)
 {
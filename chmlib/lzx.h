@@ -48,6 +48,9 @@ void LZXteardown(struct LZXstate *pState);
 /* reset an lzx stream */
 int LZXreset(struct LZXstate *pState);
 
+/* memory held by an lzx state object, window included */
+unsigned long LZXstatesize(struct LZXstate *pState);
+
 /* decompress an LZX compressed block */
 int LZXdecompress(struct LZXstate *pState,
                   unsigned char *inpos,
@@ -55,6 +58,33 @@ int LZXdecompress(struct LZXstate *pState,
                   int inlen,
                   int outlen);
 
+/* decompress an LZX compressed block, leaving the output in the window if
+ * it can.  *view points at the decompressed bytes: in the window, which
+ * holds them until the next call on pState, or in outpos, if they had to be
+ * translated.
+ */
+int LZXdecompressview(struct LZXstate *pState,
+                      unsigned char *inpos,
+                      unsigned char *outpos,
+                      int inlen,
+                      int outlen,
+                      unsigned char **view);
+
+/* opaque saved copy of a stream's state, between two blocks */
+struct LZXcheckpoint;
+
+/* save the state of an lzx stream; NULL if out of memory */
+struct LZXcheckpoint *LZXcheckpoint(struct LZXstate *pState);
+
+/* memory held by a checkpoint */
+unsigned long LZXcheckpointsize(struct LZXcheckpoint *pCheckpoint);
+
+/* resume an lzx stream from a checkpoint */
+int LZXrestore(struct LZXstate *pState, struct LZXcheckpoint *pCheckpoint);
+
+/* destroy a checkpoint */
+void LZXfreecheckpoint(struct LZXcheckpoint *pCheckpoint);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,169 @@
+/***************************************************************************
+ *          test_chmLib.c - checks of chmlib behaviour on real archives    *
+ *                           -------------------                           *
+ *                                                                         *
+ *  notes:      Runs a few checks of how chmlib manages its resources      *
+ *              against each archive named on the command line, printing   *
+ *              one line per check and exiting non-zero if any fails.      *
+ *              Build with:                                                *
+ *                                                                         *
+ *              cc -O2 -DCHM_MT -o test_chmLib                             *
+ *                 test_chmLib.c chm_lib.c lzx.c -lpthread                 *
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License as        *
+ *   published by the Free Software Foundation; either version 2.1 of the  *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "chm_lib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct object_list
+{
+    struct chmUnitInfo *objects;
+    int                 count;
+    int                 room;
+};
+
+static int _collect_compressed(struct chmFile *h,
+                               struct chmUnitInfo *ui,
+                               void *context)
+{
+    struct object_list *list = (struct object_list *)context;
+
+    (void)h;
+    if (ui->space != CHM_COMPRESSED  ||  ui->length == 0)
+        return CHM_ENUMERATOR_CONTINUE;
+    if (list->count == list->room)
+    {
+        int room = list->room ? list->room * 2 : 256;
+        struct chmUnitInfo *objects = (struct chmUnitInfo *)
+            realloc(list->objects, room * sizeof(struct chmUnitInfo));
+        if (objects == NULL)
+            return CHM_ENUMERATOR_FAILURE;
+        list->objects = objects;
+        list->room = room;
+    }
+    list->objects[list->count++] = *ui;
+    return CHM_ENUMERATOR_CONTINUE;
+}
+
+/* read an object whole; returns 0 if it comes up short */
+static int _read_object(struct chmFile *h, struct chmUnitInfo *ui)
+{
+    unsigned char *buf = (unsigned char *)malloc((size_t)ui->length);
+    int ok;
+
+    if (buf == NULL)
+        return 0;
+    ok = chm_retrieve_object(h, ui, buf, 0, (LONGINT64)ui->length)
+            == (LONGINT64)ui->length;
+    free(buf);
+    return ok;
+}
+
+/* a single thread reading forwards, then backwards, and then skipping
+ * about, needs no more than one decoder
+ */
+static int _check_serial_decoders(const char *path,
+                                  struct object_list *list)
+{
+    struct chmFile *h = chm_open(path);
+    struct chmDecoderStats stats;
+    int i, ok = 1;
+
+    if (h == NULL)
+        return 0;
+    for (i=0; i<list->count; i++)
+        ok &= _read_object(h, &list->objects[i]);
+    for (i=list->count-1; i>=0; i--)
+        ok &= _read_object(h, &list->objects[i]);
+    for (i=0; i<list->count; i++)
+        ok &= _read_object(h, &list->objects[(i * 7919) % list->count]);
+
+    chm_get_decoder_stats(h, &stats);
+    chm_close(h);
+    if (stats.decoders > 1)
+        printf("  %llu decoders after serial reads\n", stats.decoders);
+    return ok  &&  stats.decoders <= 1;
+}
+
+/* caches asked to hold more than can be allocated are held to a sane
+ * size, and take memory only as they fill
+ */
+static int _check_huge_caches(const char *path,
+                              struct object_list *list)
+{
+    struct chmFile *h = chm_open(path);
+    struct chmCacheStats before, after;
+    struct chmUnitInfo ui;
+    int i, ok = 1;
+
+    if (h == NULL)
+        return 0;
+    chm_set_param(h, CHM_PARAM_MAX_BLOCKS_CACHED, 0x7fffffff);
+    chm_set_param(h, CHM_PARAM_MAX_DIR_PAGES_CACHED, 0x7fffffff);
+    chm_get_cache_stats(h, &before);
+    for (i=0; i<list->count; i++)
+    {
+        ok &= _read_object(h, &list->objects[i]);
+        ok &= chm_resolve_object(h, list->objects[i].path, &ui)
+                == CHM_RESOLVE_SUCCESS;
+    }
+    chm_get_cache_stats(h, &after);
+    chm_close(h);
+
+    if (before.max_bytes > 256*1024*1024  ||  before.bytes != 0)
+        printf("  cache of %llu bytes, %llu held up front\n",
+               before.max_bytes, before.bytes);
+    return ok  &&  before.max_bytes <= 256*1024*1024  &&
+           before.bytes == 0  &&  after.bytes <= after.max_bytes;
+}
+
+static int _check(const char *path, const char *name, int ok)
+{
+    printf("%s: %s: %s\n", path, name, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int c, char **v)
+{
+    int i, failures = 0;
+
+    if (c < 2)
+    {
+        fprintf(stderr, "usage: %s <chmfile>...\n", v[0]);
+        exit(1);
+    }
+
+    for (i=1; i<c; i++)
+    {
+        struct chmFile *h = chm_open(v[i]);
+        struct object_list list;
+
+        if (h == NULL)
+        {
+            fprintf(stderr, "failed to open %s\n", v[i]);
+            ++failures;
+            continue;
+        }
+        memset(&list, 0, sizeof(list));
+        chm_enumerate(h, CHM_ENUMERATE_ALL, _collect_compressed, &list);
+        chm_close(h);
+
+        failures += ! _check(v[i], "serial reads use one decoder",
+                             _check_serial_decoders(v[i], &list));
+        failures += ! _check(v[i], "oversized caches are capped",
+                             _check_huge_caches(v[i], &list));
+        free(list.objects);
+    }
+    return failures != 0;
+}